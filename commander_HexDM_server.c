@@ -20,9 +20,18 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/prctl.h>
 #include <math.h>
 #include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <semaphore.h>
 #include <unistd.h>
+#include <immintrin.h>
+
+#include <string>
+#include <vector>
+#include <boost/program_options.hpp>
 
 #include <commander/commander.h>
 #include <ImageStreamIO.h>
@@ -34,76 +43,688 @@
  * ========================================================================= */
 #define LINESIZE 256
 #define CMDSIZE 200
+#define CACHELINE 64     // alignment of the buffers used by the control loop
+#define MAPPAD 8         // padding (in values) on either side of comb_map
+#define NBAND 5          // # of bands of the PTT -> actuator matrix
+#define KERN_TOL 1e-12   // tolerated relative error of the vectorized kernels
+#define MAX_CALIB 16     // max # of distinct calibrations kept in memory
+#define NCH_MAX 32       // max # of channels (of each kind) per DM
+#define ACT0 NCH_MAX     // index of the first actuator channel in a CHANTAB
+#define MODE0 (2*NCH_MAX)  // index of the modal channel in a CHANTAB
+#define PLAY0 (2*NCH_MAX+1) // index of the playback channel in a CHANTAB
+#define NCHAN (2*NCH_MAX+2) // max # of channels in a CHANTAB
+#define MODE_MAX 256     // max # of modes of a modal channel
+#define DAC_LEVELS 16384 // resolution of the driver (14-bit DACs)
 
 int ii;                  // dummy index value
-IMAGE *shmarray = NULL;  // shared memory img pointer (defined in ImageStreamIO.h)
-int nch         = 4;     // number of DM channels (default = 4)
+int nch_def     = 4;     // default number of channels per DM
+int nact_def    = 0;     // default number of actuator channels per DM
 int nseg        = 169;   // number of segments on the DM
 int ndof        = 3;     // number of d.o.f per segment (piston, tip & tilt)
 int nvact = ndof * nseg; // number of voltage actuators
 int csz         = 1024;  // size of the command expected by the driver
+int nvpad = (nvact + 7) / 8 * 8; // nvact rounded up to a multiple of 8
+uint8_t chan_type = _DATATYPE_DOUBLE; // datatype of the channels (--dtype)
+size_t chan_esz = sizeof(double);     // size of a channel element
 
-int keepgoing   = 0;     // flag to control the DM update loop
+int keepgoing   = 0;     // flag to control the DM update loops
 int allocated   = 0;     // flag to control whether shm structures are allocated
-int nch_prev    = 0;     // keep track of the # of channels before a change
+int resum_period = 1000; // full re-sum of the channels every N updates
 char dashline[80] =
   "-----------------------------------------------------------------------------\n";
 
-int ndm = 1; // the number of DMs to be connected
-DM *hdm;            // the handles for the different deformable mirrors
-BMCRC rv;           // result of every interaction with the driver (check status)
-uint32_t *map_lut;  // the DM actuator mappings
+const char *snumber = "27BW007#051";  // default DM identifier
+
+/* -------------------------------------------------------------------------
+ * conversion table used by the kernels: the band matrix comes from the
+ * calibration and is shared by all the DMs that use it (see calib_share),
+ * the flat map and command limits belong to each DM.
+ * ------------------------------------------------------------------------- */
+typedef struct {
+  const double *band;    // band matrix (band_size values, shared)
+  double *tab;           // flat map, lower & upper limits (tab_size values)
+  uint64_t gen;          // generation, bumped by each act_coef_publish()
+} CONVTAB;
+
+int band_size = NBAND * nvpad;     // size of the band matrix
+int flat_off  = 0;                 // offset of the flat map in tab
+int lo_off    = csz;               // offset of the lower limits
+int hi_off    = 2 * csz;           // offset of the upper limits
+int tab_size  = 3 * csz;           // total size of tab
+double *calib_band[MAX_CALIB];     // distinct band matrices in memory
+int calib_nref[MAX_CALIB];         // # of references to each of them
+int ncalib = 0;                    // # of band matrices in memory
+double cmd_min = 0.0;    // default lower limit of the driver commands
+double cmd_max = 1.0;    // default upper limit of the driver commands
+pthread_mutex_t calib_mutex = PTHREAD_MUTEX_INITIALIZER; // serializes loads
+
+/* -------------------------------------------------------------------------
+ * latency instrumentation: each command carries the time stamps (in ns,
+ * CLOCK_REALTIME like the shm write times) of its way to the DM. Once sent,
+ * the record goes into a ring buffer of the last LAT_NREC commands and its
+ * stage durations into log-linear histograms. Only the driver thread of the
+ * DM writes in these, nothing is time stamped when lat_on = 0. While the
+ * loop runs, the histograms are reset by the driver thread itself, on
+ * request (lat_reset), after its next command.
+ * ------------------------------------------------------------------------- */
+#define LAT_NREC  4096   // # of records kept in the ring buffer
+#define LAT_NSUB  16     // # of linear sub-buckets per power of 2
+#define LAT_NBIN  (61 * LAT_NSUB) // enough for any int64 duration in ns
+
+enum {LAT_WRITE, LAT_WAKE, LAT_COMB, LAT_CONV, LAT_SENT, LAT_NSTAMP};
+
+typedef struct {
+  uint64_t frame;            // command counter
+  int64_t t[LAT_NSTAMP];     // time stamps (ns)
+} LATREC;
+
+typedef struct {
+  uint64_t count;            // # of values in the histogram
+  int64_t vmax;              // largest value (ns)
+  uint64_t bin[LAT_NBIN];    // log-linear bins
+} LATHIST;
+
+const char *lat_names[LAT_NSTAMP] = {"wake", "combine", "convert", "send",
+				     "total"}; // stage ending at each stamp
+int lat_on = 0;          // flag to turn the latency measurements on
+
+/* -------------------------------------------------------------------------
+ * "latest wins" mailbox between the control loop and the driver thread:
+ * the loop and the driver thread each own one of the cmd_buf, the third
+ * one sits in the mailbox. Indices are swapped with atomic exchanges, the
+ * CMD_FRESH bit flagging a command not yet picked up by the driver thread.
+ *
+ * The cmd_buf are the three slices of the dmvolt shm cube: the loop
+ * computes each command in place, and publishes it by pointing cnt1 to its
+ * slice. That slice is not written again before the next publication.
+ * ------------------------------------------------------------------------- */
+#define CMD_FRESH 4
+
+/* -------------------------------------------------------------------------
+ * everything that belongs to one DM: device, channels, conversion table,
+ * command buffers, statistics and threads. The DMs are numbered from 1, and
+ * with more than one DM, the shm names get a "dmN" prefix (dm1ptt00, ...).
+ * ------------------------------------------------------------------------- */
+struct HEXDM;
+
+typedef struct {
+  IMAGE im;              // the shm data structure
+  struct HEXDM *dm;      // DM the channel belongs to
+  int kk;                // index of the channel
+  int semidx;            // semaphore index used to watch the channel
+  int watched;           // flag to keep the watcher thread running
+  pthread_t tid;         // thread ID of the watcher
+  double gain;           // scalar gain of the channel
+  int muted;             // flag to leave the channel out of the sum
+  double *weight;        // per-element weights (nvact values, NULL: none)
+  int nmode;             // number of modes (modal channel only)
+  double *basis;         // mode -> PTT basis (nmode x nvpad, modal only)
+} CHANNEL;
+
+// gain of a channel: set by the commander thread, read by the control loop
+static inline double chan_gain(const CHANNEL *ch) {
+  double gain;
+
+  __atomic_load(&ch->gain, &gain, __ATOMIC_RELAXED);
+  return gain;
+}
+
+/* -------------------------------------------------------------------------
+ * channel table: replaced as a whole (never modified) when the # of
+ * channels changes, RCU-style. The control loop picks up the new table at
+ * the start of a frame and advertises it in chans_seen: only then can the
+ * channels removed from the previous table (and the table) be destroyed.
+ *
+ * PTT channels (ptt00, ...) are chan[0..nch-1] and actuator channels
+ * (act00, ...), which bypass the PTT -> actuator conversion, are
+ * chan[ACT0..ACT0+nact-1]. The optional modal channel (modes), expanded
+ * into PTT through a basis, is chan[MODE0], and the PTT channel fed by the
+ * playback of a sequence (play) is chan[PLAY0]. A channel keeps its index,
+ * and thus its state in the loop, from one table to the next.
+ * ------------------------------------------------------------------------- */
+typedef struct {
+  int nch;                 // number of PTT channels
+  int nact;                // number of actuator channels
+  int nuse;                // number of channels in use
+  int use[NCHAN];          // indices of the channels in use
+  CHANNEL *chan[NCHAN];    // the channels
+} CHANTAB;
+
+/* -------------------------------------------------------------------------
+ * playback of a PTT sequence (FITS cube of frames of ndof x nseg values or
+ * more, like the telemetry files) into the play channel of a DM, at a fixed
+ * rate or on each update of a trigger stream. The file is memory-mapped and
+ * read ahead by the playback thread, every frame of the sequence is played.
+ * ------------------------------------------------------------------------- */
+#define PLAY_AHEAD 256   // # of frames read ahead in the sequence file
 
-int simmode = 1;  // flag to set to "1" to not attempt to connect to the driver
+typedef struct {
+  char file[LINESIZE];     // sequence file
+  char trig_name[LINESIZE]; // trigger stream ("none": fixed rate)
+  uint8_t *map;            // the file, memory-mapped (NULL: unmapped)
+  size_t size;             // size of the mapping
+  const uint8_t *data;     // first frame of the sequence
+  int bitpix;              // FITS data type (-64 or -32)
+  uint64_t stride;         // # of values per frame in the file
+  uint64_t nfrm;           // # of frames in the sequence
+  double rate;             // # of frames per second (fixed rate)
+  IMAGE trig;              // trigger stream
+  int semidx;              // semaphore index used to watch the trigger
+  CHANNEL *chan;           // channel the frames are written to
+  int running;             // flag to keep the playback thread running
+  pthread_t tid;           // thread ID of the playback
+  uint64_t nplayed;        // # of frames played
+  uint64_t nmiss;          // # of deadlines (or triggers) missed
+  LATHIST hist;            // lateness of the frames (ns)
+} PLAYBACK;
+
+typedef struct alignas(CACHELINE) HEXDM {
+  int idm;                 // DM number (from 1)
+  char serial[LINESIZE];   // DM identifier
+  char prefix[16];         // prefix of the shm names ("" or "dmN")
+  DM hdm;                  // handle of the driver
+  uint32_t *map_lut;       // the DM actuator mapping
+  double *sim_cmd;         // last command received by the simulated driver
+
+  CHANTAB *chans;          // channel table (published by set_nch)
+  CHANTAB *chans_seen;     // channel table used by the control loop
+  IMAGE *comb_im;          // the combined channel
+  sem_t dm_update_sem;     // fan-in semaphore: posted when a channel is updated
+  int dm_refresh;          // flag to force a DM update (eg. new calibration)
+
+  double *comb_map;        // combination of the channels (nvact values)
+  double *act_map;         // combination of the actuator channels (nvpad)
+  double *comb_buf;        // zero-padded storage behind comb_map
+  double *chan_prev;       // last weighted frame of each channel in the sum
+                           // (NCHAN x nvact values)
+  int resum;               // requests a full re-sum (gains changed)
+  double *chan_snap;       // consistent copy of the channel being read
+
+  CONVTAB coef_buf[2];     // double buffered conversion tables
+  CONVTAB *act_coef;       // table in use (one of coef_buf)
+  CONVTAB *coef_busy;      // table being used by the control loop (or NULL)
+  char calib_file[LINESIZE]; // origin of the PTT -> actuator matrix
+  char modes_file[LINESIZE]; // origin of the basis of the modal channel
+  char flat_file[LINESIZE];  // origin of the flat map
+  char lim_file[LINESIZE];   // origin of the command limits
+
+  IMAGE *volt_im;          // the final commands (dmvolt, holds the cmd_buf)
+  double *cmd_buf[3];      // triple buffered driver commands
+  int cmd_mbox;            // index of the command in the mailbox (| CMD_FRESH)
+  sem_t cmd_sem;           // posted when a new command is in the mailbox
+  uint64_t cmd_nsent;      // # of commands sent to the driver
+  uint64_t cmd_ndrop;      // # of commands replaced before being sent
+  uint64_t cmd_nskip;      // # of commands not sent (unchanged at DAC level)
+  uint64_t cmd_npart;      // # of commands sent one actuator at a time
+  uint16_t *dac_last;      // last command sent, in DAC levels (csz values)
+  int *dac_idx;            // actuators changed since the last command
+  int dac_known;           // flags a valid dac_last (DM state known)
+
+  uint64_t nframes;        // # of commands computed by the control loop
+  uint64_t clip_last;      // # of actuators clipped in the last command
+  uint64_t clip_max;       // max # of actuators clipped in one command
+  uint64_t clip_nfrm;      // # of commands with at least one actuator clipped
+  uint64_t clip_tot;       // total # of actuator clips
+  uint64_t torn_reads;     // # of channel copies discarded (writer active)
+  uint64_t snap_fails;     // # of times the budget was exhausted
+  uint64_t rl_ndefer;      // # of commands delayed by the rate limiter
+  uint64_t rl_ncoal;       // # of channel updates merged into another one
+  int64_t rl_last;         // start of the last command (monotonic, in ns)
+
+  LATREC cmd_lat[3];       // time stamps of the commands in cmd_buf
+  double *ptt_buf[3];      // PTT maps of the commands in cmd_buf (telemetry)
+
+  IMAGE *tlm_im;           // telemetry cube (NULL: no telemetry)
+  pthread_mutex_t tlm_mutex; // serializes the file (writer and commands)
+  int tlm_fd;              // telemetry file (-1: not recording)
+  char tlm_file[LINESIZE]; // name of the telemetry file
+  uint64_t tlm_next;       // cube counter of the next frame to save
+  uint64_t tlm_nsaved;     // # of frames saved in the file
+  uint64_t tlm_nlost;      // # of frames overwritten before being saved
+  double *tlm_buf;         // batch of frames being saved (big-endian)
+
+  PLAYBACK *play;          // last sequence played (NULL: none)
+  LATREC *lat_ring;        // ring buffer of the last LAT_NREC records
+  uint64_t lat_head;       // # of records pushed into the ring buffer
+  LATHIST *lat_hist;       // histograms of the stages (LAT_NSTAMP)
+  uint64_t lat_reset;      // # of histogram resets requested
+  uint64_t lat_gen;        // # of histogram resets done
+
+  pthread_t tid_loop;      // thread ID for DM control loop
+  pthread_t tid_drv;       // thread ID for the driver submission thread
+  int loop_cpu;            // CPU the control loop is pinned to (-1 = none)
+  int drv_cpu;             // CPU the driver thread is pinned to (-1 = none)
+  int64_t sync_t;          // submission time of the last command (sync mode)
+} HEXDM;
+
+int ndm = 1;             // the number of DMs to be connected
+HEXDM *dms = NULL;       // the different deformable mirrors
+
+/* -------------------------------------------------------------------------
+ * driver backends: the control loops only talk to the DMs through one of
+ * these (selected at startup with the --driver option)
+ * ------------------------------------------------------------------------- */
+typedef struct {
+  const char *name;                        // name used to select the backend
+  void (*open)(HEXDM *dm);                 // connects to the DM (exits on failure)
+  int (*send)(HEXDM *dm, const double *cmd); // sends csz values (0 = OK)
+  void (*close)(HEXDM *dm);                // zeroes the DM and disconnects
+  int (*send_one)(HEXDM *dm, int act, double val); // one actuator (or NULL)
+} DRIVER;
+
+DRIVER *drv = NULL;       // the backend in use
+double sim_latency = 0.0; // simulated duration of a driver call (in us)
+double sim_latency_one = 0.0; // same for a single actuator call (in us)
+
+// delta-aware writes: commands compared to the last one sent, at the
+// resolution of the DACs
+int delta_on = 1;         // skip the driver call when nothing changed
+int partial_max = 0;      // max # of changed actuators sent one by one
 char drv_status[8] = "idle"; // to keep track of server status
 
-const char *snumber = "27BW007#051";  // our DM identifier
+int snap_budget = 64;     // # of attempts to get a consistent channel copy
+
+int (*ptt_2_actuator_kernel)(const CONVTAB*, const double*, const double*,
+			     double*);
+template <typename T>
+void (*chan_accum_kernel)(const T*, const double*, double, double*, double*,
+			  int);
+void (*mode_expand_kernel)(const double*, const int*, const double*, int,
+			   double*);
+char kernel_name[16] = "scalar"; // name of the conversion kernel in use
+
+/* -------------------------------------------------------------------------
+ * real-time configuration of the threads (control loops, driver threads,
+ * channel watchers and playback) and of the memory. Applied when the loops
+ * are started (the playback thread when it starts), or right away when
+ * changed while they run. The CPUs are set per DM.
+ * ------------------------------------------------------------------------- */
+int rt_policy = SCHED_OTHER; // scheduling policy of the threads
+int rt_prio   = 0;       // real-time priority (SCHED_FIFO or SCHED_RR)
+int mem_lock  = 0;       // flag: the memory is locked (set by set_mlock)
 
-pthread_t tid_loop;      // thread ID for DM control loop
+// how the control loops wait for channel updates
+enum {WAIT_SEM, WAIT_POLL, WAIT_HYBRID};
+const char *wait_names[3] = {"sem", "poll", "hybrid"};
+int wait_mode   = WAIT_SEM; // semaphore, busy-poll on cnt0 or spin then block
+double spin_us  = 50.0;     // duration of the spin phase in hybrid mode (us)
+
+// rate limiter: min time between two commands of a DM, the channel updates
+// received meanwhile are all served by the next command
+double max_rate = 0.0;     // max # of commands per second (0: no limit)
+double min_interval = 0.0; // min time between two commands (in us)
+int64_t rl_period = 0;     // resulting min time between two commands (in ns)
+
+/* -------------------------------------------------------------------------
+ * telemetry: the driver thread of each DM copies every command it hands to
+ * the driver, with the combined PTT map it comes from, into a circular shm
+ * cube (ptt_tlm) of the last tlm_depth frames. A frame holds the PTT map
+ * (nseg rows), the command (nseg rows, same layout as the actuator
+ * channels) and a last row with the frame counter and the time it was sent
+ * (CLOCK_REALTIME s and ns). On request (tlm_record), the tlm_writer thread
+ * appends the new frames of the cube to a FITS file, in batches: only this
+ * thread waits on the disk, and the frames overwritten in the cube before
+ * it could save them are counted as lost.
+ * ------------------------------------------------------------------------- */
+#define TLM_BATCH 64     // max # of frames per write to the file
+#define TLM_POLL 5000    // period of the telemetry writer (in us)
+#define FITS_BLOCK 2880  // size of the FITS header and data blocks
+
+int tlm_depth = 0;       // # of frames in the telemetry cubes (0: none)
+int tlm_nrow = 2 * nseg + 1; // # of rows of a telemetry frame
+int tlm_fsz = ndof * tlm_nrow; // # of values of a telemetry frame
+pthread_t tid_tlm;       // thread ID for the telemetry writer
+
+/* -------------------------------------------------------------------------
+ * synchronous mode: the DMs are updated together, in cycles run by the
+ * sync_loop thread. In each cycle, the control loops (one per DM) compute
+ * their command in parallel, then the driver threads meet at a spin barrier
+ * and submit the commands at the same time. The skew between the first and
+ * the last submission of each cycle goes into a histogram.
+ * ------------------------------------------------------------------------- */
+int sync_on = 0;          // flag for the synchronous update of the DMs
+pthread_t tid_sync;       // thread ID for the synchronous cycles
+sem_t sync_sem;           // posted when any channel of any DM is updated
+sem_t sync_done_sem;      // posted when all the DMs got their command
+int sync_count  = 0;      // # of driver threads waiting at the barrier
+int sync_sense  = 0;      // phase of the barrier (flips when all arrived)
+int sync_ndone  = 0;      // # of driver threads done with the cycle
+uint64_t sync_ncycle = 0; // # of synchronous cycles
+int64_t sync_last = 0;    // submission skew of the last cycle (ns)
+LATHIST *sync_hist = NULL; // histogram of the submission skews
+
+/* =========================================================================
+ *           heap allocation check for the DM control loop
+ *
+ * When compiled with -DHOTPATH_ALLOC_CHECK (make ALLOC_CHECK=1), malloc,
+ * calloc and realloc are intercepted, and every call made from within the
+ * control loop between two HOT_PATH_ENTER() and HOT_PATH_LEAVE() markers is
+ * counted in hot_allocs. The counter should stay at zero.
+ * ========================================================================= */
+#ifdef HOTPATH_ALLOC_CHECK
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t nmemb, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+static __thread int in_hot_path = 0;
+uint64_t hot_allocs = 0;  // # of heap allocations within the control loop
+
+extern "C" void *malloc(size_t size) {
+  if (in_hot_path) __atomic_add_fetch(&hot_allocs, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t nmemb, size_t size) {
+  if (in_hot_path) __atomic_add_fetch(&hot_allocs, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(nmemb, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size) {
+  if (in_hot_path) __atomic_add_fetch(&hot_allocs, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(ptr, size);
+}
+
+#define HOT_PATH_ENTER() (in_hot_path = 1)
+#define HOT_PATH_LEAVE() (in_hot_path = 0)
+#else
+#define HOT_PATH_ENTER()
+#define HOT_PATH_LEAVE()
+#endif
 
 /* =========================================================================
  *                       function prototypes
  * ========================================================================= */
-int shm_setup();
-void* dm_control_loop(void *dummy);
-void MakeOpen(DM* hdm);
-double* ptt_2_actuator(double* ptt);
+HEXDM* dm_get(int idm);
+std::string dm_unknown(int idm);
+void dm_alloc(HEXDM *dm, int idm, const char *serial);
+void dm_free(HEXDM *dm);
+int shm_setup(HEXDM *dm);
+CHANNEL* chan_create(HEXDM *dm, int kk, int nval);
+void chan_destroy(CHANNEL *ch);
+void chan_watch_start(CHANNEL *ch);
+void chan_watch_stop(CHANNEL *ch);
+std::string chan_table_set(HEXDM *dm, int nch, int nact, CHANNEL *modal,
+			   CHANNEL *play);
+void chan_settings_publish(HEXDM *dm, int grace);
+void* dm_control_loop(void *arg);
+void* channel_watcher(void *arg);
+void* driver_loop(void *arg);
+void* sync_loop(void *dummy);
+int sync_barrier(int *sense);
+void sync_complete();
+void dm_wake(HEXDM *dm);
+void tlm_push(HEXDM *dm, int idx);
+void tlm_save(HEXDM *dm);
+void tlm_close(HEXDM *dm);
+void* tlm_writer(void *dummy);
+std::string tlm_stats(int idm);
+void* play_loop(void *arg);
+void play_ahead(PLAYBACK *pb, uint64_t k0);
+int play_trigger_wait(PLAYBACK *pb, uint64_t *cnt, int64_t *late);
+void play_halt(HEXDM *dm);
+std::string play_stats(int idm);
+void wait_for_update(HEXDM *dm, const CHANTAB *chans, const uint64_t *cntrs);
+int chan_snapshot(HEXDM *dm, IMAGE *im, void *dst, uint64_t *cnt);
+int thread_rt_apply(pthread_t tid, int cpu);
+std::string thread_rt_report(pthread_t tid, const char *name);
+int memory_lock(int on);
+std::string rt_apply();
+std::string rt_report();
+void clip_update(HEXDM *dm, int nclip);
+int64_t lat_now();
+int64_t mono_now();
+int rate_limit_wait(HEXDM *dm);
+void lat_record(HEXDM *dm, const LATREC *rec);
+void lat_percentiles(const LATHIST *hist, const double *pct, int npct,
+		     double *pval);
+void MakeOpen(HEXDM *dm);
+void bmc_open(HEXDM *dm);
+int bmc_send(HEXDM *dm, const double *cmd);
+void bmc_close(HEXDM *dm);
+int bmc_send_one(HEXDM *dm, int act, double val);
+void sim_open(HEXDM *dm);
+int sim_send(HEXDM *dm, const double *cmd);
+void sim_close(HEXDM *dm);
+int sim_send_one(HEXDM *dm, int act, double val);
+int driver_write(HEXDM *dm, const double *cmd);
+void ptt_2_actuator(const double* ptt, double* res);
+int ptt_2_actuator_scalar(const CONVTAB* cv, const double* ptt,
+                          const double* act, double* res);
+int ptt_2_actuator_avx2(const CONVTAB* cv, const double* ptt,
+                        const double* act, double* res);
+int ptt_2_actuator_avx512(const CONVTAB* cv, const double* ptt,
+                          const double* act, double* res);
+template <typename T>
+void chan_accum_scalar(const T* src, const double* wgt, double gain,
+		       double* prev, double* sum, int full);
+template <typename T> __attribute__((target("avx2,fma")))
+void chan_accum_avx2(const T* src, const double* wgt, double gain,
+		     double* prev, double* sum, int full);
+template <typename T> __attribute__((target("avx512f")))
+void chan_accum_avx512(const T* src, const double* wgt, double gain,
+		       double* prev, double* sum, int full);
+void chan_accum(const void* src, const double* wgt, double gain,
+		double* prev, double* sum, int full);
+void mode_expand_scalar(const double* basis, const int* idx, const double* dc,
+			int nidx, double* sum);
+void mode_expand_avx2(const double* basis, const int* idx, const double* dc,
+		      int nidx, double* sum);
+void mode_expand_avx512(const double* basis, const int* idx, const double* dc,
+			int nidx, double* sum);
+void mode_accum(const CHANNEL* ch, const void* src, double* prev, double* sum,
+		int full);
+int load_modes_basis(const char* fname, double** basis);
+void ideal_matrices(double* mats);
+void act_coef_fill(double* coef, const double* mats);
+const double* calib_share(const double* mats);
+const CONVTAB* act_coef_acquire(HEXDM *dm);
+void act_coef_release(HEXDM *dm);
+void act_coef_publish(HEXDM *dm, const double* band, const double* flat,
+		      const double* lims);
+int load_matrices(const char* fname, double* mats);
+int load_flat_map(const char* fname, double* flat);
+int load_weight_map(const char* fname, double** wgt);
+int load_cmd_limits(const char* fname, double* lims);
+void default_cmd_limits(double* lims);
+void ptt_kernel_select();
+double* alloc_aligned(int nval);
 
 /* =========================================================================
  *                           DM setup function
  * ========================================================================= */
-void MakeOpen(DM* hdm) {
-  memset(hdm, 0, sizeof(DM));
-  printf("Attempting to open device %s\n", snumber);
-  rv = BMCOpen(hdm, snumber);
-  
+void MakeOpen(HEXDM *dm) {
+  BMCRC rv;  // result of every interaction with the driver (check status)
+
+  memset(&dm->hdm, 0, sizeof(DM));
+  printf("Attempting to open device %s\n", dm->serial);
+  rv = BMCOpen(&dm->hdm, dm->serial);
+
   if (rv) {
-    printf("Error %d opening the driver type %u.\n", rv, (unsigned int)hdm->Driver_Type);
+    printf("Error %d opening the driver type %u.\n", rv, (unsigned int)dm->hdm.Driver_Type);
     printf("%s\n\n", BMCErrorString(rv));
 
     printf("Press any key to exit.\n");
     getc(stdin);
     exit(0);
   }
-  printf("Opened Device %d with %d actuators.\n", hdm->DevId, hdm->ActCount);
-  
-  rv = BMCLoadMap(hdm, NULL, map_lut);  // load the mapping into map_lut
+  printf("Opened Device %d with %d actuators.\n", dm->hdm.DevId, dm->hdm.ActCount);
+
+  rv = BMCLoadMap(&dm->hdm, NULL, dm->map_lut);  // load the mapping into map_lut
+}
+
+/* =========================================================================
+ *                     BMC driver backend (the real DM)
+ * ========================================================================= */
+void bmc_open(HEXDM *dm) {
+  MakeOpen(dm);
+}
+
+int bmc_send(HEXDM *dm, const double *cmd) {
+  BMCRC rv = BMCSetArray(&dm->hdm, cmd, dm->map_lut);  // send cmd to DM
+
+  if (rv) {
+    printf("%s\n\n", BMCErrorString(rv));
+  }
+  return rv;
+}
+
+void bmc_close(HEXDM *dm) {
+  BMCRC rv = BMCClearArray(&dm->hdm);
+
+  if (rv) {
+    printf("%s\n\n", BMCErrorString(rv));
+    printf("Error %d clearing voltages.\n", rv);
+  }
+
+  rv = BMCClose(&dm->hdm);
+  if (rv) {
+    printf("%s\n\n", BMCErrorString(rv));
+    printf("Error %d closing the driver.\n", rv);
+  }
+  printf("%s\n\n", BMCErrorString(rv));
+}
+
+// the actuator index goes through the default mapping of the driver, the
+// one loaded into map_lut by MakeOpen()
+int bmc_send_one(HEXDM *dm, int act, double val) {
+  BMCRC rv = BMCSetSingle(&dm->hdm, (uint32_t) act, val);
+
+  if (rv) {
+    printf("%s\n\n", BMCErrorString(rv));
+  }
+  return rv;
+}
+
+/* =========================================================================
+ *                  simulated driver backend (no hardware)
+ *
+ * Each call keeps a copy of the command and then spins for sim_latency us
+ * (sim_latency_one us for a single actuator) to mimic the duration of the
+ * USB/PCIe transaction, so that the complete combine -> convert -> send
+ * path can be timed without the DM.
+ * ========================================================================= */
+void sim_open(HEXDM *dm) {
+  printf("Simulated DM scenario: the driver is not connected\n");
+  printf("Simulated DM - serial number = %s.\n", dm->serial);
+  dm->sim_cmd = alloc_aligned(csz);
+}
+
+int sim_send(HEXDM *dm, const double *cmd) {
+  struct timespec t0, now;
+  double dt;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  memcpy(dm->sim_cmd, cmd, csz * sizeof(double));
+  do {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    dt = (now.tv_sec - t0.tv_sec) * 1e6 + (now.tv_nsec - t0.tv_nsec) * 1e-3;
+  } while (dt < sim_latency);
+  return 0;
+}
+
+void sim_close(HEXDM *dm) {
+  free(dm->sim_cmd);
+  dm->sim_cmd = NULL;
+}
+
+int sim_send_one(HEXDM *dm, int act, double val) {
+  struct timespec t0, now;
+  double dt;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  dm->sim_cmd[act] = val;
+  do {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    dt = (now.tv_sec - t0.tv_sec) * 1e6 + (now.tv_nsec - t0.tv_nsec) * 1e-3;
+  } while (dt < sim_latency_one);
+  return 0;
+}
+
+DRIVER drivers[] = {
+  {"bmc", bmc_open, bmc_send, bmc_close, bmc_send_one},
+  {"sim", sim_open, sim_send, sim_close, sim_send_one},
+};
+
+/* =========================================================================
+ *   sends a command through the backend, as cheaply as possible: not at
+ *   all if no actuator changed at the resolution of the DACs, one actuator
+ *   at a time if only a few of them (up to partial_max) changed, and the
+ *   whole array otherwise. Returns the number of driver calls made.
+ * ========================================================================= */
+static inline uint16_t dac_level(double val) {
+  return (uint16_t) lrint(fmin(fmax(val, 0.0), 1.0) * (DAC_LEVELS - 1));
+}
+
+// through backend dv, with the given delta settings (see set_delta)
+int driver_write_with(const DRIVER *dv, HEXDM *dm, const double *cmd,
+		      int delta, int nmax) {
+  int ii, act, nchg = 0, rv = 0;
+
+  if (dv->send_one == NULL)
+    nmax = 0;
+  if (delta && dm->dac_known) {
+    for (ii = 0; ii < csz; ii++)
+      if (dac_level(cmd[ii]) != dm->dac_last[ii])
+	dm->dac_idx[nchg++] = ii;
+    if (nchg == 0) {
+      __atomic_store_n(&dm->cmd_nskip, dm->cmd_nskip + 1, __ATOMIC_RELAXED);
+      return 0;
+    }
+    if (nchg <= nmax) {
+      for (ii = 0; (ii < nchg) && (rv == 0); ii++) {
+	act = dm->dac_idx[ii];
+	rv = dv->send_one(dm, act, cmd[act]);
+	dm->dac_last[act] = dac_level(cmd[act]);
+      }
+      dm->dac_known = (rv == 0); // DM state unknown after an error
+      __atomic_store_n(&dm->cmd_npart, dm->cmd_npart + 1, __ATOMIC_RELAXED);
+      return ii;
+    }
+  }
+
+  rv = dv->send(dm, cmd);
+  for (ii = 0; ii < csz; ii++)
+    dm->dac_last[ii] = dac_level(cmd[ii]);
+  dm->dac_known = (rv == 0);
+  return 1;
+}
+
+int driver_write(HEXDM *dm, const double *cmd) {
+  return driver_write_with(drv, dm, cmd,
+			   __atomic_load_n(&delta_on, __ATOMIC_RELAXED),
+			   __atomic_load_n(&partial_max, __ATOMIC_RELAXED));
+}
+
+/* =========================================================================
+ *        allocates a zeroed, cache-aligned array of nval doubles
+ * ========================================================================= */
+double* alloc_aligned(int nval) {
+  void *res = NULL;
+  size_t sz = (nval * sizeof(double) + CACHELINE - 1) / CACHELINE * CACHELINE;
+
+  if (posix_memalign(&res, CACHELINE, sz) != 0) {
+    printf("Failed to allocate %d values\n", nval);
+    exit(1);
+  }
+  memset(res, 0, sz);
+  return (double *) res;
 }
 
 /* =========================================================================
  *    conversion from PTT commands to actuator command for the driver
- * 
+ *
  * expects the 3 column ptt argument to consist in:
  * - piston values (in nanometers)
  * - tip and tilt values (in mrad)
+ *
+ * the result is written in the (preallocated) res array of csz values,
+ * of which only the first nvact are updated.
  * ========================================================================= */
-double* ptt_2_actuator(double* ptt) {
+void ptt_2_actuator(const double* ptt, double* res) {
   int ii, ii0;           // dummy variables
-  int csz = 1024;        // size of the command expected by the driver
   double again = 4000.0; // actuator gain: 4 um per ADU ? To be refined
   double a0 = 218.75;    // actuator location radius in microns
   double sq3_2 = 0;      // short hand for sqrt(3) / 2
-  double *res = (double*) malloc(csz * sizeof(double));
 
   sq3_2 = sqrt(3.0)/2.0;
   for (ii = 0; ii < nseg; ii++) {
@@ -115,244 +736,3780 @@ double* ptt_2_actuator(double* ptt) {
   
   for (ii = 0; ii < nvact; ii++)
     res[ii] /= again;
-  return res;			  
 }
 
 /* =========================================================================
- *      Allocates shared memory data structures for the new settings
+ *         banded formulation of the PTT to actuator conversion
+ *
+ * Actuator ii = 3*seg + jj only depends on the three PTT values of its own
+ * segment, located at ptt[ii-jj .. ii-jj+2]. Written over the flat array of
+ * nvact values, the conversion is therefore a band matrix with NBAND = 5
+ * diagonals:
+ *
+ *     res[ii] = sum_{dd = -2}^{+2} band[(dd+2) * nvpad + ii] * ptt[ii+dd]
+ *
+ * which is stored as structure of arrays (one contiguous array per diagonal)
+ * and vectorizes without any shuffle. The actuator gain is folded into the
+ * coefficients, and the ptt array (comb_map) is zero-padded on both sides so
+ * that the kernels can read past its edges.
+ *
+ * The kernels use the flat map of the DM (first csz values of the tab part
+ * of the conversion table) as the starting value of the sum: the flat costs
+ * no extra pass over the command. The sum of the actuator channels (act,
+ * nvpad values, or NULL if there is none) is added the same way. The lower
+ * and upper limits of each actuator command come next: the kernels clip the
+ * command to these limits before storing it, and return the number of
+ * actuators that were clipped.
+ *
+ * The band matrix is built from one 3x3 matrix per segment (mats: nseg x 9
+ * values, row-major), mapping (piston, tip, tilt) to the three actuator
+ * commands of the segment.
  * ========================================================================= */
-int shm_setup() {
-  int ii;
-  int shared = 1;
-  int NBkw = 10;
-  long naxis = 2;
-  uint8_t atype = _DATATYPE_DOUBLE;
-  uint32_t imsize[2] = {(uint32_t)ndof, (uint32_t)nseg};
-  char shmname[20];
+void ideal_matrices(double* mats) {
+  int ii, kk;
+  double again = 4000.0; // actuator gain: 4 um per ADU ? To be refined
+  double a0 = 218.75;    // actuator location radius in microns
+  double sq3_2 = sqrt(3.0)/2.0;
+  double mat[9] = {1.0,  a0 * sq3_2, a0/2.0,  // same as ptt_2_actuator
+		   1.0,         0.0,    -a0,
+		   1.0, -a0 * sq3_2, a0/2.0};
 
-  if (shmarray != NULL) { // structure must be freed before reallocation!
-    for (ii = 0; ii < nch_prev; ii++) 
-      ImageStreamIO_destroyIm(&shmarray[ii]);
-    free(shmarray);
-    shmarray = NULL;
-  }
+  for (ii = 0; ii < nseg; ii++)
+    for (kk = 0; kk < 9; kk++)
+      mats[ii * 9 + kk] = mat[kk] / again;
+}
 
-  // allocates nch arrays (+ 1 for the combined channel)
-  shmarray = (IMAGE*) malloc((nch+1) * sizeof(IMAGE));
+void act_coef_fill(double* coef, const double* mats) {
+  int ii, jj, dd;
+  const double *row;
 
-  // individual channels
-  for (ii = 0; ii < nch; ii++) {
-    sprintf(shmname, "ptt%02d", ii); // root name of the shm
-    ImageStreamIO_createIm_gpu(&shmarray[ii], shmname, naxis, imsize, atype, -1,
-			       shared, IMAGE_NB_SEMAPHORE, NBkw, MATH_DATA);
+  for (ii = 0; ii < nvact; ii++) {
+    jj = ii % ndof;
+    row = &mats[(ii / ndof) * 9 + jj * 3];  // row jj of the segment matrix
+    for (dd = -2; dd <= 2; dd++)
+      coef[(dd+2) * nvpad + ii] =
+	((jj + dd >= 0) && (jj + dd < ndof)) ? row[jj+dd] : 0.0;
   }
-  // the combined array
-  sprintf(shmname, "ptt");           // root name of the shm
-  ImageStreamIO_createIm_gpu(&shmarray[nch], shmname, naxis, imsize, atype, -1,
-			     shared, IMAGE_NB_SEMAPHORE, NBkw, MATH_DATA);
-
-  return 0;
 }
 
 /* =========================================================================
- *                     DM surface control thread
+ *    band matrices shared by the DMs: a calibration is stored only once
+ *
+ * Returns the band matrix built from mats, reusing an identical one if it
+ * is already in memory (the ideal geometry, or the same calibration used
+ * for several DMs), with a reference that act_coef_publish() hands over to
+ * a conversion table. Returns NULL when MAX_CALIB distinct calibrations
+ * are in use.
+ *
+ * Band matrices are never modified, and each entry of the coef_buf of a
+ * DM holds a reference to its band: the reference is only dropped when
+ * the (unused) entry is overwritten, so that the loops can use the
+ * matrices without any lock. A matrix is freed when its last reference
+ * goes. calib_ref() is called with calib_mutex held.
  * ========================================================================= */
-void* dm_control_loop(void *dummy) {
-  uint64_t cntrs[nch];
-  int ii, kk;  // array indices
-  double *cmd; //
-  double tmp_map[nvact];  // to store the combination of channels
+void calib_ref(const double* band, int delta) {
+  int kk;
+
+  for (kk = 0; (kk < ncalib) && (calib_band[kk] != band); kk++);
+  if (kk == ncalib) // NULL: table not filled yet
+    return;
+  if ((calib_nref[kk] += delta) > 0)
+    return;
+  free(calib_band[kk]);
+  ncalib--;
+  calib_band[kk] = calib_band[ncalib];
+  calib_nref[kk] = calib_nref[ncalib];
+}
 
-  for (ii = 0; ii < nch; ii++)
-    cntrs[ii] = shmarray[ii].md->cnt0;  // init shm counters
+const double* calib_share(const double* mats) {
+  double *band = alloc_aligned(band_size);
+  const double *res = NULL;
+  int kk;
 
-  while (keepgoing > 0) {
+  act_coef_fill(band, mats);
+  pthread_mutex_lock(&calib_mutex);
+  for (kk = 0; (kk < ncalib) && (res == NULL); kk++)
+    if (memcmp(calib_band[kk], band, band_size * sizeof(double)) == 0)
+      res = calib_band[kk];
+  if ((res == NULL) && (ncalib < MAX_CALIB)) {
+    calib_nref[ncalib] = 0;
+    res = calib_band[ncalib++] = band;
+  }
+  if (res != NULL)
+    calib_ref(res, 1);
+  pthread_mutex_unlock(&calib_mutex);
 
-    ImageStreamIO_semwait(&shmarray[nch], 1);  // waiting for a DM update!
+  if (res != band)
+    free(band);
+  return res;
+}
 
-    for (ii = 0; ii < nch; ii++)
-      cntrs[ii] = shmarray[ii].md->cnt0; // update counter values
+/* =========================================================================
+ *   reads nseg 3x3 PTT -> actuator matrices from a calibration file
+ *
+ * The file holds 9 values per segment (one segment per line, row-major),
+ * in units of driver command per nm (piston) or per mrad (tip & tilt).
+ * Lines starting with '#' are ignored. Returns 0 on success.
+ * ========================================================================= */
+int load_matrices(const char* fname, double* mats) {
+  FILE* fd;
+  char line[LINESIZE];
+  int nval = 0, nread;
+  char *pos, *end;
+  double val;
 
-    // -------- combine the channels -----------
-    for (ii = 0; ii < nvact; ii++) {
-      tmp_map[ii] = 0.0; // init temp sum array
-      for (kk = 0; kk < nch; kk++) {
-	tmp_map[ii] += shmarray[kk].array.D[ii];
-      }
+  if ((fd = fopen(fname, "r")) == NULL)
+    return -1;
+
+  while ((nval < 9 * nseg) && (fgets(line, LINESIZE, fd) != NULL)) {
+    if (line[0] == '#')
+      continue;
+    pos = line;
+    nread = 0;
+    while (nval < 9 * nseg) {
+      val = strtod(pos, &end);
+      if (end == pos)
+	break;
+      mats[nval++] = val;
+      pos = end;
+      nread++;
     }
+    if ((nread != 0) && (nread != 9)) { // one segment per line
+      fclose(fd);
+      return -2;
+    }
+  }
+  fclose(fd);
+  return (nval == 9 * nseg) ? 0 : -2;
+}
 
-    // ------- update the shared memory ---------
-    shmarray[nch].md->write = 1;   // signaling about to write
-    for (ii = 0; ii < nvact; ii++) // update the combined channel
-      shmarray[nch].array.D[ii] = tmp_map[ii];
-    shmarray[nch].md->cnt1 = 0;
-    shmarray[nch].md->cnt0++;
-    shmarray[nch].md->write = 0;  // signaling done writing
+/* =========================================================================
+ *        reads a flat map (one value per line) for the driver
+ *
+ * The Closed_Loop_Flat_Maps files hold one value per actuator of the driver
+ * command (in driver units). Returns the number of values read, the rest of
+ * the flat (up to csz) being set to zero.
+ * ========================================================================= */
+int load_flat_map(const char* fname, double* flat) {
+  FILE* fd;
+  int nval = 0;
 
-    // ------ converting into a command the driver --------
-    // sending to the DM
-    if (simmode != 1) {
-      cmd = ptt_2_actuator(shmarray[nch].array.D);
+  if ((fd = fopen(fname, "r")) == NULL)
+    return -1;
+  while ((nval < csz) && (fscanf(fd, "%lf", &flat[nval]) == 1))
+    nval++;
+  fclose(fd);
 
-      // !!!! ensure values are within acceptable range: TBD !!!!!
+  for (int ii = nval; ii < csz; ii++)
+    flat[ii] = 0.0;
+  return nval;
+}
 
-      rv = BMCSetArray(hdm, cmd, map_lut);  // send cmd to DM
-      if (rv) {
-	printf("%s\n\n", BMCErrorString(rv));
-      }
-      free(cmd);
-    }
+/* =========================================================================
+ *   basis of a modal channel: nvact PTT values (in the order of the PTT
+ *   channels) per mode, one mode after the other. Allocates *basis (one
+ *   zero-padded row of nvpad values per mode) and returns the number of
+ *   modes, -1 if the file cannot be read, -2 if its size is not valid.
+ * ========================================================================= */
+int load_modes_basis(const char* fname, double** basis) {
+  FILE* fd;
+  double *tab, val;
+  int nval = 0;
+
+  if ((fd = fopen(fname, "r")) == NULL)
+    return -1;
+  tab = alloc_aligned(MODE_MAX * nvpad);
+  while ((nval < MODE_MAX * nvact) && (fscanf(fd, "%lf", &val) == 1)) {
+    tab[nval / nvact * nvpad + nval % nvact] = val;
+    nval++;
   }
-  return NULL;
+  if ((fscanf(fd, "%lf", &val) == 1) || (nval == 0) || (nval % nvact != 0)) {
+    fclose(fd);
+    free(tab);
+    return -2;
+  }
+  fclose(fd);
+  *basis = tab;
+  return nval / nvact;
 }
 
 /* =========================================================================
- *            Functions registered with the commander server
+ *   weights of a channel: one value per element of the channel (nvact
+ *   values, in the order of its shm), applied to the frame before the PTT
+ *   -> actuator projection. Allocates *wgt and returns 0, -1 if the file
+ *   cannot be read, -2 if it does not hold exactly nvact values.
  * ========================================================================= */
+int load_weight_map(const char* fname, double** wgt) {
+  FILE* fd;
+  double *tab, val;
+  int nval = 0;
 
-void start() {
-  /* -------------------------------------------------------------------------
-   *          Starts the monitoring of shared memory data structures
-   * ------------------------------------------------------------------------- */
-  if (keepgoing == 0) {
-    keepgoing = 1; // raise the flag
-    printf("DM control loop START\n");
-    pthread_create(&tid_loop, NULL, dm_control_loop, NULL);
+  if ((fd = fopen(fname, "r")) == NULL)
+    return -1;
+  tab = alloc_aligned(nvact);
+  while ((nval < nvact) && (fscanf(fd, "%lf", &tab[nval]) == 1))
+    nval++;
+  if ((nval < nvact) || (fscanf(fd, "%lf", &val) == 1)) {
+    fclose(fd);
+    free(tab);
+    return -2;
   }
-  else
-    printf("DM control loop already running!\n");
-  sprintf(drv_status, "%s", "running");
+  fclose(fd);
+  *wgt = tab;
+  return 0;
 }
 
-void stop() {
-  /* -------------------------------------------------------------------------
-   *            Stops the monitoring of shared memory data structures
-   * ------------------------------------------------------------------------- */
-  if (keepgoing == 1)
-    keepgoing = 0;
-  else
-    printf("DM control loop already off\n");
-  sprintf(drv_status, "%s", "idle");
+/* =========================================================================
+ *             limits of the commands sent to the driver
+ *
+ * lims holds the csz lower limits followed by the csz upper limits. A limit
+ * file has one line per actuator with its lower and upper limit (in driver
+ * units); actuators not listed get the default [cmd_min, cmd_max] range.
+ * Returns the number of actuators read.
+ * ========================================================================= */
+void default_cmd_limits(double* lims) {
+  for (int ii = 0; ii < csz; ii++) {
+    lims[ii]       = cmd_min;
+    lims[csz + ii] = cmd_max;
+  }
 }
 
-std::string status() {
-  /* -------------------------------------------------------------------------
-   *                          Returns server status
-   * ------------------------------------------------------------------------- */
-  return drv_status;
+int load_cmd_limits(const char* fname, double* lims) {
+  FILE* fd;
+  int nval = 0;
+
+  if ((fd = fopen(fname, "r")) == NULL)
+    return -1;
+  default_cmd_limits(lims);
+  while ((nval < csz) &&
+	 (fscanf(fd, "%lf %lf", &lims[nval], &lims[csz + nval]) == 2))
+    nval++;
+  fclose(fd);
+  return nval;
 }
 
-int get_nch() {
-  /* -------------------------------------------------------------------------
-   *               Returns the number of virtual channels per DM
-   * ------------------------------------------------------------------------- */
-  return nch;
+/* =========================================================================
+ *   access to the conversion table (matrix + flat + limits) by the loop
+ *
+ * The table of each DM is double buffered: act_coef_publish() fills the
+ * spare buffer and swaps the act_coef pointer. Before the spare gets
+ * overwritten again, it waits until the loop no longer uses it, which the
+ * loop advertises through coef_busy (re-checked after being set to close
+ * the race with a swap). The loop then resends the DM command with the new
+ * table.
+ * ========================================================================= */
+const CONVTAB* act_coef_acquire(HEXDM *dm) {
+  CONVTAB *coef;
+
+  do {
+    coef = __atomic_load_n(&dm->act_coef, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&dm->coef_busy, coef, __ATOMIC_SEQ_CST);
+  } while (__atomic_load_n(&dm->act_coef, __ATOMIC_SEQ_CST) != coef);
+  return coef;
 }
 
-void set_nch(int ival) {
-  /* -------------------------------------------------------------------------
-   *               Updates the number of virtual channels per DM
-   * ------------------------------------------------------------------------- */
-  nch_prev = nch; // memory of the previous number of channels
-  nch = ival;
-  shm_setup();
-  printf("Success: # channels = %d\n", ival);
+void act_coef_release(HEXDM *dm) {
+  __atomic_store_n(&dm->coef_busy, (CONVTAB *) NULL, __ATOMIC_RELEASE);
 }
 
-void reset(int channel) {
-  /* -------------------------------------------------------------------------
-   *                     Resets a DM channel (or all)
-   * ------------------------------------------------------------------------- */
+// new band matrix (from calib_share, which reference is taken over), flat
+// map and/or limits: NULL keeps the ones in use
+void act_coef_publish(HEXDM *dm, const double* band, const double* flat,
+		      const double* lims) {
+  CONVTAB *spare, *coef;
 
-  double reset_map[nvact] = {0};  // reset command map 
-  double *live_channel;
-  int kk;
+  pthread_mutex_lock(&calib_mutex);
+  coef = dm->act_coef;
+  spare = (coef == &dm->coef_buf[0]) ? &dm->coef_buf[1] : &dm->coef_buf[0];
+  while (__atomic_load_n(&dm->coef_busy, __ATOMIC_SEQ_CST) == spare)
+    usleep(10); // the loop is still using the previous table
+
+  if (band == NULL)
+    calib_ref(band = coef->band, 1);
+  calib_ref(spare->band, -1); // spare no longer in use: band can go
+  spare->band = band;
+  spare->gen = coef->gen + 1; // (spare and coef alternate: not an identity)
+  memcpy(spare->tab + flat_off, (flat != NULL) ? flat : coef->tab + flat_off,
+	 csz * sizeof(double));
+  memcpy(spare->tab + lo_off, (lims != NULL) ? lims : coef->tab + lo_off,
+	 2 * csz * sizeof(double));
+
+  __atomic_store_n(&dm->act_coef, spare, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&calib_mutex);
+
+  dm_wake(dm);
+}
+
+int ptt_2_actuator_scalar(const CONVTAB* cv, const double* ptt,
+                          const double* act, double* res) {
+  int ii, nclip = 0;
+  const double *c0 = cv->band, *c1 = c0 + nvpad, *c2 = c1 + nvpad;
+  const double *c3 = c2 + nvpad, *c4 = c3 + nvpad;
+  const double *flat = cv->tab + flat_off;
+  const double *lo = cv->tab + lo_off, *hi = cv->tab + hi_off;
+  double val;
 
-  if (channel < 0) {
-    for (kk = 0; kk < nch; kk++) {
-      live_channel = shmarray[kk].array.D;  // live pointer
-      shmarray[kk].md->write = 1;           // signaling about to write
-      memcpy(live_channel, (double *) reset_map, sizeof(double) * nvact);
-      shmarray[kk].md->cnt0++;
-      ImageStreamIO_sempost(&shmarray[kk], -1);
-      shmarray[kk].md->write = 0;   // done writing
-    }
-  }
-  else if (channel < nch) {
-    kk = channel;
-    live_channel = shmarray[kk].array.D;  // live pointer
-    shmarray[kk].md->write = 1;           // signaling about to write
-    memcpy(live_channel, (double *) reset_map, sizeof(double) * nvact);
-    shmarray[kk].md->cnt0++;
-    ImageStreamIO_sempost(&shmarray[kk], -1);
-    shmarray[kk].md->write = 0;   // done writing
+  for (ii = 0; ii < nvpad; ii++) {
+    val = flat[ii] + c0[ii] * ptt[ii-2] + c1[ii] * ptt[ii-1] +
+      c2[ii] * ptt[ii] + c3[ii] * ptt[ii+1] + c4[ii] * ptt[ii+2];
+    if (act != NULL)
+      val += act[ii];
+    nclip += (val < lo[ii]) || (val > hi[ii]);
+    res[ii] = fmin(fmax(val, lo[ii]), hi[ii]);
   }
-  else
-    printf("Virtual channels 0-%d have been set-up!\n", nch);
+  return nclip;
 }
 
-void quit() {
-  /* -------------------------------------------------------------------------
-   *                       Clean exit of the program.
-   * ------------------------------------------------------------------------- */
-  if (keepgoing == 1) stop();
-  
-  printf("DM driver server shutting down!\n");
-  
-  if (simmode != 1) {
-    rv = BMCClearArray(hdm);
-    if (rv) {
-      printf("%s\n\n", BMCErrorString(rv));
-      printf("Error %d clearing voltages.\n", rv);
-    }
-    
-    rv = BMCClose(hdm);
-    if (rv) {
-      printf("%s\n\n", BMCErrorString(rv));
-      printf("Error %d closing the driver.\n", rv);
-    }
-    printf("%s\n\n", BMCErrorString(rv));
+__attribute__((target("avx2,fma")))
+int ptt_2_actuator_avx2(const CONVTAB* cv, const double* ptt,
+                        const double* act, double* res) {
+  int ii, nclip = 0;
+  const double *c0 = cv->band, *c1 = c0 + nvpad, *c2 = c1 + nvpad;
+  const double *c3 = c2 + nvpad, *c4 = c3 + nvpad;
+  const double *flat = cv->tab + flat_off;
+  const double *lo = cv->tab + lo_off, *hi = cv->tab + hi_off;
+  __m256d acc, vlo, vhi;
+
+  for (ii = 0; ii < nvpad; ii += 4) {
+    acc = _mm256_load_pd(flat + ii);
+    acc = _mm256_fmadd_pd(_mm256_load_pd(c0 + ii), _mm256_loadu_pd(ptt + ii - 2), acc);
+    acc = _mm256_fmadd_pd(_mm256_load_pd(c1 + ii), _mm256_loadu_pd(ptt + ii - 1), acc);
+    acc = _mm256_fmadd_pd(_mm256_load_pd(c2 + ii), _mm256_load_pd(ptt + ii), acc);
+    acc = _mm256_fmadd_pd(_mm256_load_pd(c3 + ii), _mm256_loadu_pd(ptt + ii + 1), acc);
+    acc = _mm256_fmadd_pd(_mm256_load_pd(c4 + ii), _mm256_loadu_pd(ptt + ii + 2), acc);
+    if (act != NULL)
+      acc = _mm256_add_pd(acc, _mm256_load_pd(act + ii));
+    vlo = _mm256_load_pd(lo + ii);
+    vhi = _mm256_load_pd(hi + ii);
+    nclip += __builtin_popcount(_mm256_movemask_pd(
+      _mm256_or_pd(_mm256_cmp_pd(acc, vlo, _CMP_LT_OQ),
+		   _mm256_cmp_pd(acc, vhi, _CMP_GT_OQ))));
+    _mm256_storeu_pd(res + ii, _mm256_min_pd(_mm256_max_pd(acc, vlo), vhi));
   }
-  free(map_lut);
+  return nclip;
+}
 
-  if (shmarray != NULL) { // free the data structure
-    for (int ii = 0; ii < nch + 1; ii++) {
-      ImageStreamIO_destroyIm(&shmarray[ii]);
-    }
-    free(shmarray);
-    shmarray = NULL;
+__attribute__((target("avx512f")))
+int ptt_2_actuator_avx512(const CONVTAB* cv, const double* ptt,
+                          const double* act, double* res) {
+  int ii, nclip = 0;
+  const double *c0 = cv->band, *c1 = c0 + nvpad, *c2 = c1 + nvpad;
+  const double *c3 = c2 + nvpad, *c4 = c3 + nvpad;
+  const double *flat = cv->tab + flat_off;
+  const double *lo = cv->tab + lo_off, *hi = cv->tab + hi_off;
+  __m512d acc, vlo, vhi;
+
+  for (ii = 0; ii < nvpad; ii += 8) {
+    acc = _mm512_load_pd(flat + ii);
+    acc = _mm512_fmadd_pd(_mm512_load_pd(c0 + ii), _mm512_loadu_pd(ptt + ii - 2), acc);
+    acc = _mm512_fmadd_pd(_mm512_load_pd(c1 + ii), _mm512_loadu_pd(ptt + ii - 1), acc);
+    acc = _mm512_fmadd_pd(_mm512_load_pd(c2 + ii), _mm512_load_pd(ptt + ii), acc);
+    acc = _mm512_fmadd_pd(_mm512_load_pd(c3 + ii), _mm512_loadu_pd(ptt + ii + 1), acc);
+    acc = _mm512_fmadd_pd(_mm512_load_pd(c4 + ii), _mm512_loadu_pd(ptt + ii + 2), acc);
+    if (act != NULL)
+      acc = _mm512_add_pd(acc, _mm512_load_pd(act + ii));
+    vlo = _mm512_load_pd(lo + ii);
+    vhi = _mm512_load_pd(hi + ii);
+    nclip += __builtin_popcount(_mm512_cmp_pd_mask(acc, vlo, _CMP_LT_OQ) |
+				_mm512_cmp_pd_mask(acc, vhi, _CMP_GT_OQ));
+    _mm512_storeu_pd(res + ii, _mm512_min_pd(_mm512_max_pd(acc, vlo), vhi));
   }
-  exit(0);
+  return nclip;
 }
 
-namespace co=commander;
+/* =========================================================================
+ *        weighted accumulation of one channel into the running sum
+ *
+ * The contribution of the channel (gain x weight x frame) replaces its
+ * previous one (prev) in the sum, in one pass over the frame. For a full
+ * re-sum (full = 1), prev is not subtracted. wgt = NULL: no weights.
+ * The frame is either double or float (--dtype), the sum is always double.
+ * ========================================================================= */
+__attribute__((target("avx2,fma")))
+inline __m256d load4_pd(const double* src) {
+  return _mm256_loadu_pd(src);
+}
 
-COMMANDER_REGISTER(m) {
-  using namespace co::literals;
-  m.def("start", start, "Starts monitoring shared memory data structures.");
-  m.def("stop", stop, "Stops monitoring shared memory data structures.");
-  m.def("status", status, "Returns status of the DM server.");
-  m.def("get_nch", get_nch, "Returns the number of virtual channels per DM.");
-  m.def("set_nch", set_nch, "Updates the number of virtual channels per DM.");
-  m.def("reset", reset, "Resets DM channel #arg_0 (all if arg_0=-1).");
+__attribute__((target("avx2,fma")))
+inline __m256d load4_pd(const float* src) {
+  return _mm256_cvtps_pd(_mm_loadu_ps(src));
+}
+
+__attribute__((target("avx512f")))
+inline __m512d load8_pd(const double* src) {
+  return _mm512_loadu_pd(src);
+}
+
+__attribute__((target("avx512f")))
+inline __m512d load8_pd(const float* src) {
+  return _mm512_cvtps_pd(_mm256_loadu_ps(src));
+}
+
+template <typename T>
+void chan_accum_scalar(const T* src, const double* wgt, double gain,
+		       double* prev, double* sum, int full) {
+  int ii;
+  double val;
+
+  for (ii = 0; ii < nvact; ii++) {
+    val = (wgt != NULL) ? gain * wgt[ii] * src[ii] : gain * src[ii];
+    sum[ii] += full ? val : val - prev[ii];
+    prev[ii] = val;
+  }
+}
+
+template <typename T>
+__attribute__((target("avx2,fma")))
+void chan_accum_avx2(const T* src, const double* wgt, double gain,
+		     double* prev, double* sum, int full) {
+  int ii;
+  double val;
+  __m256d vg = _mm256_set1_pd(gain), vval, vsum;
+
+  for (ii = 0; ii + 4 <= nvact; ii += 4) {
+    vval = _mm256_mul_pd(vg, load4_pd(src + ii));
+    if (wgt != NULL)
+      vval = _mm256_mul_pd(vval, _mm256_loadu_pd(wgt + ii));
+    vsum = _mm256_add_pd(_mm256_loadu_pd(sum + ii), vval);
+    if (!full)
+      vsum = _mm256_sub_pd(vsum, _mm256_loadu_pd(prev + ii));
+    _mm256_storeu_pd(sum + ii, vsum);
+    _mm256_storeu_pd(prev + ii, vval);
+  }
+  for (; ii < nvact; ii++) { // tail
+    val = (wgt != NULL) ? gain * src[ii] * wgt[ii] : gain * src[ii];
+    sum[ii] += full ? val : val - prev[ii];
+    prev[ii] = val;
+  }
+}
+
+template <typename T>
+__attribute__((target("avx512f")))
+void chan_accum_avx512(const T* src, const double* wgt, double gain,
+		       double* prev, double* sum, int full) {
+  int ii;
+  double val;
+  __m512d vg = _mm512_set1_pd(gain), vval, vsum;
+
+  for (ii = 0; ii + 8 <= nvact; ii += 8) {
+    vval = _mm512_mul_pd(vg, load8_pd(src + ii));
+    if (wgt != NULL)
+      vval = _mm512_mul_pd(vval, _mm512_loadu_pd(wgt + ii));
+    vsum = _mm512_add_pd(_mm512_loadu_pd(sum + ii), vval);
+    if (!full)
+      vsum = _mm512_sub_pd(vsum, _mm512_loadu_pd(prev + ii));
+    _mm512_storeu_pd(sum + ii, vsum);
+    _mm512_storeu_pd(prev + ii, vval);
+  }
+  for (; ii < nvact; ii++) { // tail
+    val = (wgt != NULL) ? gain * src[ii] * wgt[ii] : gain * src[ii];
+    sum[ii] += full ? val : val - prev[ii];
+    prev[ii] = val;
+  }
+}
+
+void chan_accum(const void* src, const double* wgt, double gain,
+		double* prev, double* sum, int full) {
+  if (chan_type == _DATATYPE_FLOAT)
+    chan_accum_kernel<float>((const float*) src, wgt, gain, prev, sum, full);
+  else
+    chan_accum_kernel<double>((const double*) src, wgt, gain, prev, sum, full);
 }
 
 /* =========================================================================
- *                                Main program
+ *          expansion of modal coefficients into the PTT running sum
+ *
+ * Blocked GEMV: sum += basis^T dc, restricted to the nidx modes idx[] with
+ * a non-zero coefficient dc[]. Modes are taken four at a time, so that the
+ * sum is loaded and stored once per block rather than once per mode. Basis
+ * rows are nvpad long and zero-padded: the padding of the sum stays zero.
  * ========================================================================= */
-int main(int argc, char **argv) {
+void mode_expand_scalar(const double* basis, const int* idx, const double* dc,
+			int nidx, double* sum) {
+  const double *b0, *b1, *b2, *b3;
+  double d0, d1, d2, d3;
+  int ii, jj;
+
+  for (jj = 0; jj < nidx; jj += 4) {
+    b0 = basis + idx[jj] * nvpad;
+    d0 = dc[jj];
+    b1 = (jj + 1 < nidx) ? basis + idx[jj+1] * nvpad : b0;
+    d1 = (jj + 1 < nidx) ? dc[jj+1] : 0.0;
+    b2 = (jj + 2 < nidx) ? basis + idx[jj+2] * nvpad : b0;
+    d2 = (jj + 2 < nidx) ? dc[jj+2] : 0.0;
+    b3 = (jj + 3 < nidx) ? basis + idx[jj+3] * nvpad : b0;
+    d3 = (jj + 3 < nidx) ? dc[jj+3] : 0.0;
+    for (ii = 0; ii < nvpad; ii++)
+      sum[ii] += d0 * b0[ii] + d1 * b1[ii] + d2 * b2[ii] + d3 * b3[ii];
+  }
+}
 
-  hdm = (DM *) malloc(sizeof(DM));
-  map_lut = (uint32_t *) malloc(sizeof(uint32_t)*MAX_DM_SIZE);
+__attribute__((target("avx2,fma")))
+void mode_expand_avx2(const double* basis, const int* idx, const double* dc,
+		      int nidx, double* sum) {
+  const double *b0, *b1, *b2, *b3;
+  __m256d d0, d1, d2, d3, acc;
+  int ii, jj;
 
-  if (simmode != 1) 
-    MakeOpen(hdm);
-  else {
-    printf("Simulated DM scenario: the driver is not connected\n");
-    printf("Simulated DM - serial number = %s.\n", snumber);
+  for (jj = 0; jj < nidx; jj += 4) {
+    b0 = basis + idx[jj] * nvpad;
+    d0 = _mm256_set1_pd(dc[jj]);
+    b1 = (jj + 1 < nidx) ? basis + idx[jj+1] * nvpad : b0;
+    d1 = _mm256_set1_pd((jj + 1 < nidx) ? dc[jj+1] : 0.0);
+    b2 = (jj + 2 < nidx) ? basis + idx[jj+2] * nvpad : b0;
+    d2 = _mm256_set1_pd((jj + 2 < nidx) ? dc[jj+2] : 0.0);
+    b3 = (jj + 3 < nidx) ? basis + idx[jj+3] * nvpad : b0;
+    d3 = _mm256_set1_pd((jj + 3 < nidx) ? dc[jj+3] : 0.0);
+    for (ii = 0; ii < nvpad; ii += 4) {
+      acc = _mm256_loadu_pd(sum + ii);
+      acc = _mm256_fmadd_pd(d0, _mm256_load_pd(b0 + ii), acc);
+      acc = _mm256_fmadd_pd(d1, _mm256_load_pd(b1 + ii), acc);
+      acc = _mm256_fmadd_pd(d2, _mm256_load_pd(b2 + ii), acc);
+      acc = _mm256_fmadd_pd(d3, _mm256_load_pd(b3 + ii), acc);
+      _mm256_storeu_pd(sum + ii, acc);
+    }
+  }
+}
+
+__attribute__((target("avx512f")))
+void mode_expand_avx512(const double* basis, const int* idx, const double* dc,
+			int nidx, double* sum) {
+  const double *b0, *b1, *b2, *b3;
+  __m512d d0, d1, d2, d3, acc;
+  int ii, jj;
+
+  for (jj = 0; jj < nidx; jj += 4) {
+    b0 = basis + idx[jj] * nvpad;
+    d0 = _mm512_set1_pd(dc[jj]);
+    b1 = (jj + 1 < nidx) ? basis + idx[jj+1] * nvpad : b0;
+    d1 = _mm512_set1_pd((jj + 1 < nidx) ? dc[jj+1] : 0.0);
+    b2 = (jj + 2 < nidx) ? basis + idx[jj+2] * nvpad : b0;
+    d2 = _mm512_set1_pd((jj + 2 < nidx) ? dc[jj+2] : 0.0);
+    b3 = (jj + 3 < nidx) ? basis + idx[jj+3] * nvpad : b0;
+    d3 = _mm512_set1_pd((jj + 3 < nidx) ? dc[jj+3] : 0.0);
+    for (ii = 0; ii < nvpad; ii += 8) {
+      acc = _mm512_loadu_pd(sum + ii);
+      acc = _mm512_fmadd_pd(d0, _mm512_load_pd(b0 + ii), acc);
+      acc = _mm512_fmadd_pd(d1, _mm512_load_pd(b1 + ii), acc);
+      acc = _mm512_fmadd_pd(d2, _mm512_load_pd(b2 + ii), acc);
+      acc = _mm512_fmadd_pd(d3, _mm512_load_pd(b3 + ii), acc);
+      _mm512_storeu_pd(sum + ii, acc);
+    }
+  }
+}
+
+// modal counterpart of chan_accum: prev holds the (gain scaled) modal
+// coefficients last added to the sum, and only the ones that changed are
+// expanded (all the non-zero ones for a full re-sum). src = NULL: re-adds
+// the coefficients in prev (the channel could not be read).
+void mode_accum(const CHANNEL* ch, const void* src, double* prev, double* sum,
+		int full) {
+  int idx[MODE_MAX];
+  double dc[MODE_MAX];
+  double val, delta, gain = chan_gain(ch);
+  int mm, nidx = 0;
+
+  for (mm = 0; mm < ch->nmode; mm++) {
+    if (src == NULL)
+      val = prev[mm];
+    else if (chan_type == _DATATYPE_FLOAT)
+      val = gain * ((const float *) src)[mm];
+    else
+      val = gain * ((const double *) src)[mm];
+    delta = full ? val : val - prev[mm];
+    prev[mm] = val;
+    if (delta != 0.0) {
+      idx[nidx] = mm;
+      dc[nidx++] = delta;
+    }
+  }
+  if (nidx > 0)
+    mode_expand_kernel(__atomic_load_n(&ch->basis, __ATOMIC_ACQUIRE), idx, dc,
+		       nidx, sum);
+}
+
+/* =========================================================================
+ *   picks the fastest conversion kernel supported by the CPU and checks it
+ *   against the reference ptt_2_actuator() on a random PTT map, using the
+ *   ideal geometry and no limits. Falls back to the scalar version if the
+ *   relative error exceeds KERN_TOL.
+ * ========================================================================= */
+void ptt_kernel_select() {
+  int ii;
+  double *ptt = alloc_aligned(nvpad + 2 * MAPPAD) + MAPPAD;
+  double *ref = alloc_aligned(csz);
+  double *res = alloc_aligned(csz);
+  double *band = alloc_aligned(band_size);
+  double *tab = alloc_aligned(tab_size);
+  CONVTAB cv = {band, tab, 0};
+  double mats[nseg * 9];
+  double err = 0.0, amax = 0.0;
+
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    ptt_2_actuator_kernel = ptt_2_actuator_avx512;
+    chan_accum_kernel<double> = chan_accum_avx512<double>;
+    chan_accum_kernel<float> = chan_accum_avx512<float>;
+    mode_expand_kernel = mode_expand_avx512;
+    sprintf(kernel_name, "avx512");
+  }
+  else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    ptt_2_actuator_kernel = ptt_2_actuator_avx2;
+    chan_accum_kernel<double> = chan_accum_avx2<double>;
+    chan_accum_kernel<float> = chan_accum_avx2<float>;
+    mode_expand_kernel = mode_expand_avx2;
+    sprintf(kernel_name, "avx2");
+  }
+  else {
+    ptt_2_actuator_kernel = ptt_2_actuator_scalar;
+    chan_accum_kernel<double> = chan_accum_scalar<double>;
+    chan_accum_kernel<float> = chan_accum_scalar<float>;
+    mode_expand_kernel = mode_expand_scalar;
+    sprintf(kernel_name, "scalar");
+  }
+
+  srand(1);
+  for (ii = 0; ii < nseg; ii++) {
+    ptt[ii*ndof]   = 2000.0 * (rand() / (double) RAND_MAX - 0.5);  // nm
+    ptt[ii*ndof+1] = 2.0 * (rand() / (double) RAND_MAX - 0.5);     // mrad
+    ptt[ii*ndof+2] = 2.0 * (rand() / (double) RAND_MAX - 0.5);     // mrad
+  }
+  ideal_matrices(mats);
+  act_coef_fill(band, mats);
+  for (ii = 0; ii < csz; ii++) {
+    tab[lo_off + ii] = -HUGE_VAL;
+    tab[hi_off + ii] = HUGE_VAL;
+  }
+  ptt_2_actuator(ptt, ref);
+  ptt_2_actuator_kernel(&cv, ptt, NULL, res);
+  for (ii = 0; ii < nvact; ii++) {
+    err = fmax(err, fabs(res[ii] - ref[ii]));
+    amax = fmax(amax, fabs(ref[ii]));
+  }
+  printf("PTT -> actuator kernel: %s (max rel. error = %.2e)\n",
+	 kernel_name, err / amax);
+  if (err > KERN_TOL * amax) {
+    printf("Kernel error above tolerance: using the scalar version instead\n");
+    ptt_2_actuator_kernel = ptt_2_actuator_scalar;
+    chan_accum_kernel<double> = chan_accum_scalar<double>;
+    chan_accum_kernel<float> = chan_accum_scalar<float>;
+    mode_expand_kernel = mode_expand_scalar;
+    sprintf(kernel_name, "scalar");
+  }
+  free(band);
+  free(tab);
+  free(ptt - MAPPAD);
+  free(ref);
+  free(res);
+}
+
+/* =========================================================================
+ *       DM #idm (numbered from 1 like the shm names), or NULL if unknown
+ * ========================================================================= */
+HEXDM* dm_get(int idm) {
+  if ((idm < 1) || (idm > ndm))
+    return NULL;
+  return &dms[idm - 1];
+}
+
+std::string dm_unknown(int idm) {
+  char msg[LINESIZE];
+
+  snprintf(msg, LINESIZE, "Unknown DM #%d (DMs 1-%d are connected)", idm, ndm);
+  return msg;
+}
+
+/* =========================================================================
+ *      allocates the buffers of DM #idm (shm structures: shm_setup)
+ * ========================================================================= */
+void dm_alloc(HEXDM *dm, int idm, const char *serial) {
+  int kk;
+
+  memset((void *) dm, 0, sizeof(HEXDM));
+  dm->idm = idm;
+  snprintf(dm->serial, LINESIZE, "%s", serial);
+  if (ndm > 1)
+    snprintf(dm->prefix, sizeof(dm->prefix), "dm%d", idm);
+  dm->loop_cpu = -1;
+  dm->drv_cpu = -1;
+
+  dm->map_lut = (uint32_t *) malloc(sizeof(uint32_t)*MAX_DM_SIZE);
+  dm->dac_last = (uint16_t *) calloc(csz, sizeof(uint16_t));
+  dm->dac_idx = (int *) calloc(csz, sizeof(int));
+  dm->comb_buf = alloc_aligned(nvpad + 2 * MAPPAD);
+  dm->comb_map = dm->comb_buf + MAPPAD;
+  dm->chan_snap = alloc_aligned(nvact);
+  dm->chan_prev = alloc_aligned(NCHAN * nvact);
+  dm->act_map = alloc_aligned(nvpad);
+  for (kk = 0; kk < 2; kk++)
+    dm->coef_buf[kk].tab = alloc_aligned(tab_size);
+  dm->act_coef = &dm->coef_buf[1];
+  for (kk = 0; kk < 3; kk++) // (the cmd_buf live in the shm)
+    dm->ptt_buf[kk] = alloc_aligned(nvact);
+  dm->cmd_mbox = 1;
+  pthread_mutex_init(&dm->tlm_mutex, NULL);
+  dm->tlm_fd = -1;
+  sem_init(&dm->dm_update_sem, 0, 0);
+  sem_init(&dm->cmd_sem, 0, 0);
+  dm->lat_ring = (LATREC *) calloc(LAT_NREC, sizeof(LATREC));
+  dm->lat_hist = (LATHIST *) calloc(LAT_NSTAMP, sizeof(LATHIST));
+
+  sprintf(dm->calib_file, "ideal");
+  sprintf(dm->modes_file, "none");
+  sprintf(dm->flat_file, "none");
+  sprintf(dm->lim_file, "default");
+}
+
+void dm_free(HEXDM *dm) {
+  int kk;
+
+  free(dm->map_lut);
+  free(dm->dac_last);
+  free(dm->dac_idx);
+  free(dm->comb_buf);
+  free(dm->chan_snap);
+  free(dm->act_map);
+  free(dm->chan_prev);
+  for (kk = 0; kk < 2; kk++)
+    free(dm->coef_buf[kk].tab);
+  for (kk = 0; kk < 3; kk++)
+    free(dm->ptt_buf[kk]);
+  if (dm->play != NULL) { // before the play channel is destroyed
+    play_halt(dm);
+    free(dm->play);
+    dm->play = NULL;
+  }
+  free(dm->lat_ring);
+  free(dm->lat_hist);
+  sem_destroy(&dm->dm_update_sem);
+  sem_destroy(&dm->cmd_sem);
+
+  if (dm->chans != NULL) { // free the data structures
+    for (kk = 0; kk < dm->chans->nuse; kk++)
+      chan_destroy(dm->chans->chan[dm->chans->use[kk]]);
+    free(dm->chans);
+    dm->chans = NULL;
+    ImageStreamIO_destroyIm(dm->comb_im);
+    free(dm->comb_im);
+    dm->comb_im = NULL;
+    ImageStreamIO_destroyIm(dm->volt_im);
+    free(dm->volt_im);
+    dm->volt_im = NULL;
+    for (kk = 0; kk < 3; kk++)
+      dm->cmd_buf[kk] = NULL;
+  }
+  if (dm->tlm_im != NULL) {
+    tlm_close(dm);
+    ImageStreamIO_destroyIm(dm->tlm_im);
+    free(dm->tlm_im);
+    dm->tlm_im = NULL;
+  }
+  free(dm->tlm_buf);
+  pthread_mutex_destroy(&dm->tlm_mutex);
+}
+
+/* =========================================================================
+ *   Allocates the shared memory data structures of a DM: the combined
+ *   channel, the final commands, the nch_def first channels, nact_def
+ *   actuator channels and the telemetry cube (if tlm_depth > 0)
+ * ========================================================================= */
+int shm_setup(HEXDM *dm) {
+  int kk;
+  int shared = 1;
+  int NBkw = 10;
+  long naxis = 2;
+  uint8_t atype = chan_type;
+  uint32_t imsize[2] = {(uint32_t)ndof, (uint32_t)nseg};
+  uint32_t voltsize[3] = {(uint32_t)csz, 1, 3};
+  char shmname[32];
+
+  // individual channels
+  dm->chans = (CHANTAB *) calloc(1, sizeof(CHANTAB));
+  dm->chans_seen = dm->chans;
+  chan_table_set(dm, nch_def, nact_def, NULL, NULL);
+
+  // the combined array
+  dm->comb_im = (IMAGE *) malloc(sizeof(IMAGE));
+  sprintf(shmname, "%sptt", dm->prefix);          // root name of the shm
+  ImageStreamIO_createIm_gpu(dm->comb_im, shmname, naxis, imsize, atype, -1,
+			     shared, IMAGE_NB_SEMAPHORE, NBkw, MATH_DATA);
+
+  // the final commands: one slice per cmd_buf, cnt1 = the last published
+  dm->volt_im = (IMAGE *) malloc(sizeof(IMAGE));
+  sprintf(shmname, "%sdmvolt", dm->prefix);
+  ImageStreamIO_createIm_gpu(dm->volt_im, shmname, 3, voltsize,
+			     _DATATYPE_DOUBLE, -1, shared, IMAGE_NB_SEMAPHORE,
+			     NBkw, MATH_DATA);
+  for (kk = 0; kk < 3; kk++)
+    dm->cmd_buf[kk] = dm->volt_im->array.D + kk * csz;
+
+  // the telemetry cube (always double)
+  if (tlm_depth > 0) {
+    uint32_t cubesize[3] = {(uint32_t)ndof, (uint32_t)tlm_nrow,
+			    (uint32_t)tlm_depth};
+
+    dm->tlm_im = (IMAGE *) malloc(sizeof(IMAGE));
+    sprintf(shmname, "%sptt_tlm", dm->prefix);
+    ImageStreamIO_createIm_gpu(dm->tlm_im, shmname, 3, cubesize,
+			       _DATATYPE_DOUBLE, -1, shared,
+			       IMAGE_NB_SEMAPHORE, NBkw, MATH_DATA);
+    dm->tlm_buf = alloc_aligned(TLM_BATCH * tlm_fsz);
+  }
+  return 0;
+}
+
+/* =========================================================================
+ *                creation & destruction of one channel
+ * ========================================================================= */
+// nval: number of modes of the modal channel (ignored for the others)
+CHANNEL* chan_create(HEXDM *dm, int kk, int nval) {
+  CHANNEL *ch = (CHANNEL *) calloc(1, sizeof(CHANNEL));
+  int shared = 1;
+  int NBkw = 10;
+  long naxis = 2;
+  uint8_t atype = chan_type;
+  uint32_t imsize[2] = {(uint32_t)ndof, (uint32_t)nseg};
+  char shmname[32];
+
+  ch->dm = dm;
+  ch->kk = kk;
+  ch->gain = 1.0;
+  if (kk < ACT0)                                 // root name of the shm
+    sprintf(shmname, "%sptt%02d", dm->prefix, kk);
+  else if (kk < MODE0)
+    sprintf(shmname, "%sact%02d", dm->prefix, kk - ACT0);
+  else if (kk == MODE0) {
+    sprintf(shmname, "%smodes", dm->prefix);
+    imsize[0] = (uint32_t) nval;
+    imsize[1] = 1;
+    ch->nmode = nval;
+  }
+  else
+    sprintf(shmname, "%splay", dm->prefix);
+  ImageStreamIO_createIm_gpu(&ch->im, shmname, naxis, imsize, atype, -1,
+			     shared, IMAGE_NB_SEMAPHORE, NBkw, MATH_DATA);
+  return ch;
+}
+
+void chan_destroy(CHANNEL *ch) {
+  ImageStreamIO_destroyIm(&ch->im);
+  free(ch->weight);
+  free(ch->basis);
+  free(ch);
+}
+
+/* =========================================================================
+ *   makes the control loop take new channel settings (gain, mute, weights)
+ *   into account, with a full re-sum of the channels. With grace = 1, only
+ *   returns once the loop has moved to a new frame, after which it no
+ *   longer uses the weights that were replaced.
+ * ========================================================================= */
+void chan_settings_publish(HEXDM *dm, int grace) {
+  __atomic_store_n(&dm->resum, 1, __ATOMIC_RELEASE);
+  if (keepgoing != 1)
+    return;
+  dm_wake(dm);
+  while (grace && __atomic_load_n(&dm->resum, __ATOMIC_ACQUIRE))
+    usleep(100);
+}
+
+/* =========================================================================
+ *   Returns channel #channel of a DM, as numbered by the commands: PTT
+ *   channels from 0, actuator channels from ACT0 (32), the modal channel
+ *   at MODE0 (64) and the playback channel at PLAY0 (65). NULL (and the
+ *   error in msg) if the DM has no such channel.
+ * ========================================================================= */
+CHANNEL *chan_lookup(HEXDM *dm, int channel, char *msg) {
+  if ((channel >= 0) && (channel < NCHAN) && (dm->chans->chan[channel] != NULL))
+    return dm->chans->chan[channel];
+  snprintf(msg, LINESIZE, "No channel #%d (PTT channels from 0, actuator "
+	   "channels from %d, modal %d, playback %d: see chan_status)", channel,
+	   ACT0, MODE0, PLAY0);
+  return NULL;
+}
+
+/* =========================================================================
+ *   Changes the # of channels of a DM, while the loop runs or not
+ *
+ * The channels that are kept are not touched (their shm, content and
+ * readers stay), new ones are created and get a watcher before the new
+ * table is published. The removed ones are only destroyed after the
+ * control loop switched to the new table, at a frame boundary: the loop
+ * keeps updating the DM all along. modal and play are the (new, current
+ * or NULL) modal and playback channels.
+ * ========================================================================= */
+std::string chan_table_set(HEXDM *dm, int nch, int nact, CHANNEL *modal,
+			   CHANNEL *play) {
+  CHANTAB *old = dm->chans, *tab;
+  char msg[LINESIZE];
+  int kk;
+
+  if ((nch < 1) || (nch > NCH_MAX)) {
+    snprintf(msg, LINESIZE, "Invalid # of channels: %d (1-%d)", nch, NCH_MAX);
+    return msg;
+  }
+  if ((nact < 0) || (nact > NCH_MAX)) {
+    snprintf(msg, LINESIZE, "Invalid # of actuator channels: %d (0-%d)",
+	     nact, NCH_MAX);
+    return msg;
+  }
+  if ((nch == old->nch) && (nact == old->nact) &&
+      (modal == old->chan[MODE0]) && (play == old->chan[PLAY0]))
+    return "";
+
+  tab = (CHANTAB *) calloc(1, sizeof(CHANTAB));
+  tab->nch = nch;
+  tab->nact = nact;
+  for (kk = 0; kk < NCHAN; kk++) {
+    if (kk == MODE0)
+      tab->chan[kk] = modal;
+    else if (kk == PLAY0)
+      tab->chan[kk] = play;
+    else if ((kk < ACT0) ? (kk < nch) : (kk - ACT0 < nact))
+      tab->chan[kk] = (old->chan[kk] != NULL) ? old->chan[kk]
+	: chan_create(dm, kk, 0);
+    if (tab->chan[kk] == NULL)
+      continue;
+    tab->use[tab->nuse++] = kk;
+    if ((tab->chan[kk] != old->chan[kk]) && (keepgoing == 1))
+      chan_watch_start(tab->chan[kk]);
+  }
+
+  __atomic_store_n(&dm->chans, tab, __ATOMIC_RELEASE);
+  if (keepgoing == 1) { // wait until the loop uses the new table
+    dm_wake(dm);
+    while (__atomic_load_n(&dm->chans_seen, __ATOMIC_ACQUIRE) != tab)
+      usleep(100);
+  }
+  else
+    dm->chans_seen = tab;
+
+  for (kk = 0; kk < old->nuse; kk++) { // channels removed or replaced
+    if (tab->chan[old->use[kk]] == old->chan[old->use[kk]])
+      continue;
+    if (keepgoing == 1)
+      chan_watch_stop(old->chan[old->use[kk]]);
+    chan_destroy(old->chan[old->use[kk]]);
+  }
+  free(old);
+  return "";
+}
+
+/* =========================================================================
+ *                      Channel watcher threads
+ *
+ * ImageStreamIO semaphores are attached to one image each, so there is no
+ * way to block on "any of the nch channels" with a single call. Each channel
+ * gets a watcher that blocks on one of its semaphores (an index that is not
+ * already used by another reader) and forwards the event to the process-local
+ * dm_update_sem of its DM, on which the control loop waits (or to sync_sem
+ * in synchronous mode, which starts a cycle for all the DMs).
+ *
+ * The timed wait is only there to notice that the loop was stopped, or
+ * that the channel is being removed.
+ * ========================================================================= */
+void* channel_watcher(void *arg) {
+  CHANNEL *ch = (CHANNEL *) arg;  // the watched channel
+  HEXDM *dm = ch->dm;
+  struct timespec tout;
+
+  while ((keepgoing > 0) && __atomic_load_n(&ch->watched, __ATOMIC_ACQUIRE)) {
+    clock_gettime(CLOCK_REALTIME, &tout);
+    tout.tv_nsec += 100000000; // 100 ms
+    if (tout.tv_nsec >= 1000000000) {
+      tout.tv_sec++;
+      tout.tv_nsec -= 1000000000;
+    }
+    if (ImageStreamIO_semtimedwait(&ch->im, ch->semidx, &tout) == 0)
+      sem_post(sync_on ? &sync_sem : &dm->dm_update_sem); // wake up the loop
+  }
+  return NULL;
+}
+
+// the semaphore index is claimed (semReadPID) for as long as the watcher
+// runs, and handed back when it stops: without that, each start/stop or
+// channel table change would use up one more of the IMAGE_NB_SEMAPHORE.
+void chan_watch_start(CHANNEL *ch) {
+  ch->watched = 0;
+  if ((ch->semidx = ImageStreamIO_getsemwaitindex(&ch->im, 0)) < 0) {
+    printf("%s: no free semaphore, channel not watched\n", ch->im.md->name);
+    return;
+  }
+  ImageStreamIO_semflush(&ch->im, ch->semidx);
+  ch->watched = 1;
+  pthread_create(&ch->tid, NULL, channel_watcher, ch);
+  thread_rt_apply(ch->tid, -1); // same scheduling, no pinning
+}
+
+void chan_watch_stop(CHANNEL *ch) {
+  if (!__atomic_load_n(&ch->watched, __ATOMIC_ACQUIRE))
+    return; // no watcher was started
+  __atomic_store_n(&ch->watched, 0, __ATOMIC_RELEASE);
+  pthread_join(ch->tid, NULL);
+  ch->im.semReadPID[ch->semidx] = 0; // semaphore free for other readers
+  ch->semidx = -1;
+}
+
+/* =========================================================================
+ *   clipping statistics: only written by the control loop of the DM, read
+ *   by the commander thread (relaxed atomics, no lock)
+ * ========================================================================= */
+void clip_update(HEXDM *dm, int nclip) {
+  uint64_t nc = (uint64_t) nclip;
+
+  __atomic_store_n(&dm->nframes, dm->nframes + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&dm->clip_last, nc, __ATOMIC_RELAXED);
+  if (nc > 0) {
+    __atomic_store_n(&dm->clip_nfrm, dm->clip_nfrm + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&dm->clip_tot, dm->clip_tot + nc, __ATOMIC_RELAXED);
+    if (nc > dm->clip_max)
+      __atomic_store_n(&dm->clip_max, nc, __ATOMIC_RELAXED);
+  }
+}
+
+/* =========================================================================
+ *                  latency time stamps and histograms
+ * ========================================================================= */
+int64_t lat_now() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+int64_t mono_now() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static inline int64_t lat_ts(const struct timespec *ts) {
+  return (int64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+// bins are exact below LAT_NSUB ns, then LAT_NSUB per power of 2 (~6%)
+static inline int lat_bin(int64_t val) {
+  int ex;
+
+  if (val < LAT_NSUB)
+    return (val < 0) ? 0 : (int) val;
+  ex = 63 - __builtin_clzll((uint64_t) val);  // >= 4
+  return (ex - 3) * LAT_NSUB + (int) ((val >> (ex - 4)) & (LAT_NSUB - 1));
+}
+
+// middle of a bin, in ns
+static inline double lat_bin_value(int bin) {
+  int ex;
+
+  if (bin < LAT_NSUB)
+    return bin;
+  ex = bin / LAT_NSUB + 3;
+  return ((LAT_NSUB + bin % LAT_NSUB) + 0.5) * (double) (1LL << (ex - 4));
+}
+
+// called by the driver thread for every command sent to the DM. Stage kk
+// ends at stamp kk+1, the last one (total) goes from write to sent.
+void lat_record(HEXDM *dm, const LATREC *rec) {
+  LATHIST *hist;
+  int64_t dt;
+  int kk;
+
+  dm->lat_ring[dm->lat_head % LAT_NREC] = *rec;
+  __atomic_store_n(&dm->lat_head, dm->lat_head + 1, __ATOMIC_RELEASE);
+
+  for (kk = 0; kk < LAT_NSTAMP; kk++) {
+    hist = &dm->lat_hist[kk];
+    dt = (kk < LAT_SENT) ? rec->t[kk+1] - rec->t[kk]
+      : rec->t[LAT_SENT] - rec->t[LAT_WRITE];
+    __atomic_store_n(&hist->bin[lat_bin(dt)], hist->bin[lat_bin(dt)] + 1,
+		     __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->count, hist->count + 1, __ATOMIC_RELAXED);
+    if (dt > hist->vmax)
+      __atomic_store_n(&hist->vmax, dt, __ATOMIC_RELAXED);
+  }
+}
+
+// values (in ns) below which the fractions pct[] of a histogram lie
+void lat_percentiles(const LATHIST *hist, const double *pct, int npct,
+		     double *pval) {
+  uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+  uint64_t cumul = 0;
+  int jj, bin = 0;
+
+  for (jj = 0; jj < npct; jj++) {
+    while ((bin < LAT_NBIN) && (cumul + hist->bin[bin] < pct[jj] * count))
+      cumul += hist->bin[bin++];
+    pval[jj] = fmin(lat_bin_value(bin),  // not beyond the largest value
+		    (double) __atomic_load_n(&hist->vmax, __ATOMIC_RELAXED));
+  }
+}
+
+
+/* =========================================================================
+ *                real-time settings of threads and memory
+ * ========================================================================= */
+const char* rt_policy_name(int policy) {
+  if (policy == SCHED_FIFO) return "fifo";
+  if (policy == SCHED_RR) return "rr";
+  return "other";
+}
+
+// applies rt_policy/rt_prio and pins to cpu (if >= 0): returns 0 or errno
+int thread_rt_apply(pthread_t tid, int cpu) {
+  struct sched_param param;
+  cpu_set_t cpuset;
+  int res, err = 0;
+
+  param.sched_priority = (rt_policy == SCHED_OTHER) ? 0 : rt_prio;
+  if ((res = pthread_setschedparam(tid, rt_policy, &param)) != 0)
+    err = res;
+
+  CPU_ZERO(&cpuset);
+  if (cpu >= 0)
+    CPU_SET(cpu, &cpuset);
+  else // no pinning: any CPU
+    for (int kk = 0; kk < CPU_SETSIZE; kk++)
+      CPU_SET(kk, &cpuset);
+  if ((res = pthread_setaffinity_np(tid, sizeof(cpuset), &cpuset)) != 0)
+    err = res;
+  return err;
+}
+
+// reports the scheduling and affinity actually in effect for a thread
+std::string thread_rt_report(pthread_t tid, const char *name) {
+  struct sched_param param;
+  cpu_set_t cpuset;
+  int policy, ncpu = 0, cpu = -1;
+  char msg[LINESIZE];
+
+  pthread_getschedparam(tid, &policy, &param);
+  pthread_getaffinity_np(tid, sizeof(cpuset), &cpuset);
+  for (int kk = 0; kk < CPU_SETSIZE; kk++)
+    if (CPU_ISSET(kk, &cpuset)) {
+      ncpu++;
+      cpu = kk;
+    }
+  if (ncpu == 1)
+    snprintf(msg, LINESIZE, "%s: %s prio %d - CPU %d", name,
+	     rt_policy_name(policy), param.sched_priority, cpu);
+  else
+    snprintf(msg, LINESIZE, "%s: %s prio %d - %d CPUs", name,
+	     rt_policy_name(policy), param.sched_priority, ncpu);
+  return msg;
+}
+
+// mlockall() and prefaulting of the buffers used by the loops: 0 or errno
+int memory_lock(int on) {
+  volatile double sum = 0.0;
+  long pgsz = sysconf(_SC_PAGESIZE) / sizeof(double);
+  uint64_t nbyte;
+  IMAGE *im;
+  int kk, idm;
+  uint64_t jj;
+  HEXDM *dm;
+
+  if (on == 0)
+    return (munlockall() == 0) ? 0 : errno;
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+    return errno;
+
+  // prefault (read) every page of the channels and of the loop buffers
+  pthread_mutex_lock(&calib_mutex);
+  for (kk = 0; kk < ncalib; kk++)
+    for (jj = 0; jj < (uint64_t) band_size; jj += pgsz)
+      sum += calib_band[kk][jj];
+  pthread_mutex_unlock(&calib_mutex);
+  for (idm = 0; idm < ndm; idm++) {
+    dm = &dms[idm];
+    for (kk = 0; (dm->chans != NULL) && (kk < dm->chans->nuse); kk++) {
+      im = &dm->chans->chan[dm->chans->use[kk]]->im;
+      nbyte = im->md->nelement * chan_esz;
+      for (jj = 0; jj < nbyte; jj += pgsz * sizeof(double))
+	sum += im->array.UI8[jj];
+    }
+    nbyte = (dm->comb_im != NULL) ? dm->comb_im->md->nelement * chan_esz : 0;
+    for (jj = 0; jj < nbyte; jj += pgsz * sizeof(double))
+      sum += dm->comb_im->array.UI8[jj];
+    for (jj = 0; jj < (uint64_t) tab_size; jj += pgsz)
+      sum += dm->coef_buf[0].tab[jj] + dm->coef_buf[1].tab[jj];
+    for (kk = 0; kk < 3; kk++)
+      for (jj = 0; jj < (uint64_t) csz; jj += pgsz)
+	sum += dm->cmd_buf[kk][jj];
+  }
+  (void) sum;
+  return 0;
+}
+
+/* =========================================================================
+ *              waits until the loop has something to do
+ *
+ * - WAIT_SEM: blocks on the fan-in semaphore posted by the channel watchers
+ * - WAIT_POLL: spins on the cnt0 counters of the channels (for a dedicated,
+ *   isolated core), avoiding the scheduler wake-up latency
+ * - WAIT_HYBRID: spins for spin_us, then blocks on the semaphore
+ *
+ * In synchronous mode, the loop only runs when sync_loop starts a cycle
+ * (which sets dm_refresh): the channel counters are not watched.
+ *
+ * Pending semaphore posts are drained before returning, whatever the mode.
+ * ========================================================================= */
+void wait_for_update(HEXDM *dm, const CHANTAB *chans, const uint64_t *cntrs) {
+  int mode = __atomic_load_n(&wait_mode, __ATOMIC_RELAXED);
+  struct timespec t0, now;
+  double spin = spin_us * 1e3; // in ns
+  int jj, kk, iter = 0;
+  int nwatch = sync_on ? 0 : chans->nuse; // # of channel counters watched
+
+  if (mode != WAIT_SEM) {
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while (keepgoing > 0) {
+      for (jj = 0; jj < nwatch; jj++) {
+	kk = chans->use[jj];
+	if (__atomic_load_n(&chans->chan[kk]->im.md->cnt0, __ATOMIC_ACQUIRE) != cntrs[kk])
+	  goto updated;
+      }
+      if (__atomic_load_n(&dm->dm_refresh, __ATOMIC_ACQUIRE))
+	goto updated;
+      _mm_pause();
+
+      if ((++iter & 63) == 0) { // do not read the clock at every iteration
+	if (__atomic_load_n(&wait_mode, __ATOMIC_RELAXED) != mode)
+	  break; // mode changed while spinning: fall back to the semaphore
+	if (mode == WAIT_HYBRID) {
+	  clock_gettime(CLOCK_MONOTONIC, &now);
+	  if ((now.tv_sec - t0.tv_sec) * 1e9 + (now.tv_nsec - t0.tv_nsec) > spin)
+	    break;
+	}
+      }
+    }
+    if (keepgoing == 0)
+      return;
+  }
+  sem_wait(&dm->dm_update_sem);  // waiting for a DM update on any channel!
+
+ updated:
+  while (sem_trywait(&dm->dm_update_sem) == 0); // coalesce pending posts
+}
+
+/* =========================================================================
+ *          consistent copy of a channel that may be being written
+ *
+ * Seqlock-like protocol on the ImageStreamIO metadata, that writers follow
+ * already (write = 1, update, cnt0++, write = 0): the copy is only valid if
+ * no write was flagged before or after it and cnt0 did not move meanwhile.
+ * Nothing is locked: the writer is never held. If no valid copy is obtained
+ * within snap_budget attempts, the channel is left for the next iteration
+ * (counter not updated, loop woken up again). Returns 0 on success.
+ * ========================================================================= */
+int chan_snapshot(HEXDM *dm, IMAGE *im, void *dst, uint64_t *cnt) {
+  IMAGE_METADATA *md = im->md;
+  uint64_t c0;
+  int itry;
+
+  for (itry = 0; itry < snap_budget; itry++) {
+    c0 = __atomic_load_n(&md->cnt0, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&md->write, __ATOMIC_ACQUIRE) == 0) {
+      memcpy(dst, im->array.raw, md->nelement * chan_esz);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if ((__atomic_load_n(&md->write, __ATOMIC_RELAXED) == 0) &&
+	  (__atomic_load_n(&md->cnt0, __ATOMIC_RELAXED) == c0)) {
+	*cnt = c0;
+	return 0;
+      }
+      __atomic_store_n(&dm->torn_reads, dm->torn_reads + 1, __ATOMIC_RELAXED);
+    }
+    _mm_pause();
+  }
+  __atomic_store_n(&dm->snap_fails, dm->snap_fails + 1, __ATOMIC_RELAXED);
+  dm_wake(dm); // come back later
+  return -1;
+}
+
+/* =========================================================================
+ *   rate limiter: holds the loop of the DM until rl_period has elapsed
+ *   since its last command. The posts received meanwhile are drained: the
+ *   channels updated during the wait are all read in the coming frame.
+ *   Returns 1 if the loop had to wait.
+ * ========================================================================= */
+int rate_limit_wait(HEXDM *dm) {
+  int64_t period = __atomic_load_n(&rl_period, __ATOMIC_RELAXED);
+  int64_t deadline = dm->rl_last + period;
+  struct timespec ts;
+
+  if ((period <= 0) || (mono_now() >= deadline))
+    return 0;
+  ts.tv_sec = deadline / 1000000000;
+  ts.tv_nsec = deadline % 1000000000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+  while (sem_trywait(&dm->dm_update_sem) == 0); // coalesce pending posts
+  return 1;
+}
+
+/* =========================================================================
+ *                     DM surface control thread
+ *
+ * One per DM (arg: the HEXDM), with its own channels, conversion table and
+ * driver thread: the DMs are updated independently of each other.
+ * ========================================================================= */
+void* dm_control_loop(void *arg) {
+  HEXDM *dm = (HEXDM *) arg;
+  const CHANTAB *chans = __atomic_load_n(&dm->chans, __ATOMIC_ACQUIRE);
+  const CHANTAB *tab;     // latest channel table
+  IMAGE *im;              // channel shortcut
+  uint64_t cntrs[NCHAN];
+  int ii, jj, kk;  // array indices
+  int updated; // number of channels updated since last iteration
+  int changed[NCHAN];     // flags the channels updated since last iteration
+  int nupdate = 0;        // number of updates since the last full re-sum
+  double *tmp_map = dm->comb_map;  // running sum of the channels
+  double *act_map = dm->act_map;   // running sum of the actuator channels
+  double *sum;            // running sum a channel belongs to
+  void *snap = dm->chan_snap;      // consistent copy of a channel
+  const void *src;                 // frame of a channel (NULL: unread)
+  double *prev;           // channel shortcut
+  CHANNEL *ch;            // channel shortcut
+  double val;
+  const CONVTAB *coef;     // conversion table in use
+  uint64_t gen_prev[3] = {~0ULL, ~0ULL, ~0ULL}; // table generation per cmd_buf
+  int nclip, tail_clip = 0;  // # of clipped actuators (all & beyond nvpad)
+  int widx = 0, old;         // index of the cmd_buf owned by the loop
+  double *dm_cmd;            // command being computed
+  LATREC *lat;               // time stamps of the command being computed
+  int64_t t_wake = 0, t_write, t_chan;
+  int timed;                 // flags a command with time stamps
+  int deferred;              // flags a command delayed by the rate limiter
+  int refresh;               // flags a forced update (or a sync cycle)
+  uint64_t val64, nwrite;
+
+  if (mem_lock) { // prefault the stack of the loop
+    volatile char stack[65536];
+    for (size_t off = 0; off < sizeof(stack); off += 4096)
+      stack[off] = 0;  // volatile stores: not optimized away
+  }
+
+  for (jj = 0; jj < chans->nuse; jj++) { // init shm counters
+    kk = chans->use[jj];
+    cntrs[kk] = chans->chan[kk]->im.md->cnt0;
+  }
+  __atomic_store_n(&dm->chans_seen, chans, __ATOMIC_RELEASE);
+
+  while (keepgoing > 0) {
+
+    wait_for_update(dm, chans, cntrs);
+    HOT_PATH_ENTER();
+    // synchronous mode: one command per cycle, and only then. A left-over
+    // semaphore post must not publish an extra command, which would keep
+    // the driver thread one cycle ahead of the others at the barrier.
+    refresh = __atomic_exchange_n(&dm->dm_refresh, 0, __ATOMIC_ACQ_REL);
+    if (sync_on && !refresh) {
+      HOT_PATH_LEAVE();
+      continue;
+    }
+    timed = __atomic_load_n(&lat_on, __ATOMIC_RELAXED);
+    if (timed)
+      t_wake = lat_now();
+    deferred = rate_limit_wait(dm);
+
+    updated = 0;
+    // new channel table (set_nch): the channels that were already there
+    // keep their state, the new ones are read in a full re-sum
+    tab = __atomic_load_n(&dm->chans, __ATOMIC_ACQUIRE);
+    if (tab != chans) {
+      for (jj = 0; jj < tab->nuse; jj++) {
+	kk = tab->use[jj];
+	if (tab->chan[kk] == chans->chan[kk])
+	  continue;
+	memset(&dm->chan_prev[kk * nvact], 0, nvact * sizeof(double));
+	cntrs[kk] = tab->chan[kk]->im.md->cnt0 - 1; // never read yet
+      }
+      chans = tab;
+      nupdate = 0;
+      updated++;
+      __atomic_store_n(&dm->chans_seen, chans, __ATOMIC_RELEASE);
+    }
+    if (__atomic_exchange_n(&dm->resum, 0, __ATOMIC_ACQ_REL)) {
+      nupdate = 0; // new gains or weights
+      updated++;
+    }
+
+    t_write = t_wake;
+    nwrite = 0;
+    for (jj = 0; jj < chans->nuse; jj++) {
+      kk = chans->use[jj];
+      im = &chans->chan[kk]->im;
+      val64 = __atomic_load_n(&im->md->cnt0, __ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&chans->chan[kk]->muted, __ATOMIC_RELAXED)) {
+	cntrs[kk] = val64; // muted channel: updates are ignored
+	changed[kk] = 0;
+	continue;
+      }
+      changed[kk] = (val64 != cntrs[kk]);
+      if (changed[kk]) { // counter updated once the channel is read
+	updated++;
+	nwrite += val64 - cntrs[kk];
+	if (timed) { // oldest write among the updated channels
+	  t_chan = lat_ts(&im->md->writetime);
+	  if (t_chan == 0)
+	    t_chan = lat_ts(&im->md->atime);
+	  if ((t_chan > 0) && (t_chan < t_write))
+	    t_write = t_chan;
+	}
+      }
+    }
+    if (refresh)
+      updated++; // the conversion changed: the command must be resent
+    if (updated == 0) { // stop() request or spurious wake up
+      HOT_PATH_LEAVE();
+      continue;
+    }
+    dm->rl_last = mono_now();
+    if (deferred)
+      __atomic_store_n(&dm->rl_ndefer, dm->rl_ndefer + 1, __ATOMIC_RELAXED);
+    if (nwrite > 1)
+      __atomic_store_n(&dm->rl_ncoal, dm->rl_ncoal + nwrite - 1,
+		       __ATOMIC_RELAXED);
+
+    // -------- combine the channels -----------
+    // only the channels that changed are added to the running sum (as the
+    // difference with their previous weighted frame). A full re-sum is done
+    // from time to time to keep rounding errors from accumulating, and when
+    // the gains change. A channel that cannot be read consistently keeps its
+    // previous frame. Muted channels are not read at all. Actuator
+    // channels are summed apart, and added to the converted PTT map. The
+    // modal channel is expanded into the PTT map (mode_accum).
+    if (nupdate == 0) {
+      for (ii = 0; ii < nvact; ii++) {
+	tmp_map[ii] = 0.0; // init temp sum arrays
+	act_map[ii] = 0.0;
+      }
+      for (jj = 0; jj < chans->nuse; jj++) {
+	kk = chans->use[jj];
+	ch = chans->chan[kk];
+	if (__atomic_load_n(&ch->muted, __ATOMIC_RELAXED))
+	  continue;
+	sum = ((kk >= ACT0) && (kk < MODE0)) ? act_map : tmp_map;
+	prev = &dm->chan_prev[kk * nvact];
+	src = (chan_snapshot(dm, &ch->im, snap, &cntrs[kk]) == 0) ? snap : NULL;
+	if (kk == MODE0) // src = NULL: keeps its previous frame
+	  mode_accum(ch, src, prev, sum, 1);
+	else if (src != NULL)
+	  chan_accum(src, __atomic_load_n(&ch->weight, __ATOMIC_ACQUIRE),
+		     chan_gain(ch), prev, sum, 1);
+	else
+	  for (ii = 0; ii < nvact; ii++)
+	    sum[ii] += prev[ii];
+      }
+    }
+    else {
+      for (jj = 0; jj < chans->nuse; jj++) {
+	kk = chans->use[jj];
+	ch = chans->chan[kk];
+	if ((changed[kk] == 0) ||
+	    (chan_snapshot(dm, &ch->im, snap, &cntrs[kk]) != 0))
+	  continue;
+	if (kk == MODE0)
+	  mode_accum(ch, snap, &dm->chan_prev[kk * nvact], tmp_map, 0);
+	else
+	  chan_accum(snap, __atomic_load_n(&ch->weight, __ATOMIC_ACQUIRE),
+		     chan_gain(ch), &dm->chan_prev[kk * nvact],
+		     ((kk >= ACT0) && (kk < MODE0)) ? act_map : tmp_map, 0);
+      }
+    }
+    if (++nupdate >= resum_period)
+      nupdate = 0;
+
+    // ------- update the shared memory ---------
+    im = dm->comb_im;
+    im->md->write = 1;             // signaling about to write
+    if (chan_type == _DATATYPE_FLOAT) // update the combined channel
+      for (ii = 0; ii < nvact; ii++)
+	im->array.F[ii] = (float) tmp_map[ii];
+    else
+      memcpy(im->array.D, tmp_map, nvact * sizeof(double));
+    im->md->cnt1 = 0;
+    im->md->cnt0++;
+    im->md->write = 0;            // signaling done writing
+    ImageStreamIO_sempost(im, -1);
+
+    lat = &dm->cmd_lat[widx];
+    if (timed) {
+      lat->t[LAT_WRITE] = t_write;
+      lat->t[LAT_WAKE] = t_wake;
+      lat->t[LAT_COMB] = lat_now();
+    }
+
+    if (dm->tlm_im != NULL) // PTT map of the command, for the telemetry
+      memcpy(dm->ptt_buf[widx], tmp_map, nvact * sizeof(double));
+
+    // ------ converting into a command the driver --------
+    dm_cmd = dm->cmd_buf[widx];
+    coef = act_coef_acquire(dm);
+    nclip = ptt_2_actuator_kernel(coef, tmp_map,
+				  (chans->nact > 0) ? act_map : NULL, dm_cmd);
+    if (coef->gen != gen_prev[widx]) { // flat beyond the kernels' actuators
+      tail_clip = 0;
+      for (ii = nvpad; ii < csz; ii++) {
+	val = coef->tab[flat_off + ii];
+	tail_clip += (val < coef->tab[lo_off + ii]) ||
+	  (val > coef->tab[hi_off + ii]);
+	dm_cmd[ii] = fmin(fmax(val, coef->tab[lo_off + ii]),
+			  coef->tab[hi_off + ii]);
+      }
+      gen_prev[widx] = coef->gen;
+    }
+    act_coef_release(dm);
+    clip_update(dm, nclip + tail_clip);
+    lat->frame = dm->nframes;
+    lat->t[LAT_CONV] = timed ? lat_now() : 0;
+
+    // publish the command (dmvolt), and hand it over to the driver thread
+    im = dm->volt_im;
+    im->md->write = 1;
+    im->md->cnt1 = widx;
+    im->md->cnt0++;
+    im->md->write = 0;
+    ImageStreamIO_sempost(im, -1);
+
+    old = __atomic_exchange_n(&dm->cmd_mbox, widx | CMD_FRESH, __ATOMIC_ACQ_REL);
+    if (old & CMD_FRESH) // the previous command was never sent
+      __atomic_store_n(&dm->cmd_ndrop, dm->cmd_ndrop + 1, __ATOMIC_RELAXED);
+    widx = old & ~CMD_FRESH;
+    sem_post(&dm->cmd_sem);
+    HOT_PATH_LEAVE();
+  }
+  return NULL;
+}
+
+/* =========================================================================
+ *   asks for a new command of the DM (eg. new calibration): right away, or
+ *   through the next cycle in synchronous mode (in which all the DMs get a
+ *   new command anyway)
+ * ========================================================================= */
+void dm_wake(HEXDM *dm) {
+  if (sync_on)
+    sem_post(&sync_sem);
+  else {
+    __atomic_store_n(&dm->dm_refresh, 1, __ATOMIC_RELEASE);
+    sem_post(&dm->dm_update_sem);
+  }
+}
+
+/* =========================================================================
+ *                  synchronous update cycles of the DMs
+ *
+ * Cycles are run one at a time: updates received during a cycle are all
+ * served by the next one. In each cycle, every control loop computes a
+ * command (channels updated or not), so that every driver thread has one
+ * to send and meets the others at the barrier.
+ * ========================================================================= */
+void* sync_loop(void *dummy) {
+  int kk;
+
+  (void) dummy;
+  while (keepgoing > 0) {
+    sem_wait(&sync_sem);
+    while (sem_trywait(&sync_sem) == 0); // coalesce pending posts
+    if (keepgoing == 0)
+      break;
+
+    for (kk = 0; kk < ndm; kk++) { // start the cycle on all the workers
+      __atomic_store_n(&dms[kk].dm_refresh, 1, __ATOMIC_RELEASE);
+      sem_post(&dms[kk].dm_update_sem);
+    }
+    sem_wait(&sync_done_sem);  // all the DMs got their command
+  }
+  return NULL;
+}
+
+// sense-reversing spin barrier between the ndm driver threads: returns 0
+// once all of them arrived, -1 if the loop was stopped meanwhile
+int sync_barrier(int *sense) {
+  *sense = !*sense;
+  if (__atomic_add_fetch(&sync_count, 1, __ATOMIC_ACQ_REL) == ndm) {
+    __atomic_store_n(&sync_count, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&sync_sense, *sense, __ATOMIC_RELEASE); // release all
+    return 0;
+  }
+  while (__atomic_load_n(&sync_sense, __ATOMIC_ACQUIRE) != *sense) {
+    if (keepgoing == 0)
+      return -1;
+    _mm_pause();
+  }
+  return 0;
+}
+
+// called by each driver thread after its submission: the last one of the
+// cycle records the skew between the submissions and ends the cycle
+void sync_complete() {
+  int64_t tmin, tmax, skew;
+  int kk;
+
+  if (__atomic_add_fetch(&sync_ndone, 1, __ATOMIC_ACQ_REL) < ndm)
+    return;
+
+  tmin = tmax = dms[0].sync_t;
+  for (kk = 1; kk < ndm; kk++) {
+    tmin = (dms[kk].sync_t < tmin) ? dms[kk].sync_t : tmin;
+    tmax = (dms[kk].sync_t > tmax) ? dms[kk].sync_t : tmax;
+  }
+  skew = tmax - tmin;
+  __atomic_store_n(&sync_last, skew, __ATOMIC_RELAXED);
+  __atomic_store_n(&sync_hist->bin[lat_bin(skew)],
+		   sync_hist->bin[lat_bin(skew)] + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&sync_hist->count, sync_hist->count + 1, __ATOMIC_RELAXED);
+  if (skew > sync_hist->vmax)
+    __atomic_store_n(&sync_hist->vmax, skew, __ATOMIC_RELAXED);
+  __atomic_store_n(&sync_ncycle, sync_ncycle + 1, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&sync_ndone, 0, __ATOMIC_RELAXED);
+  sem_post(&sync_done_sem);
+}
+
+/* =========================================================================
+ *   telemetry: copies the command in cmd_buf[idx] (just handed to the
+ *   driver) and its PTT map into the next frame of the cube. Only called
+ *   by the driver thread of the DM.
+ * ========================================================================= */
+void tlm_push(HEXDM *dm, int idx) {
+  IMAGE *im = dm->tlm_im;
+  uint64_t cnt = im->md->cnt0;
+  double *frm = im->array.D + (cnt % tlm_depth) * tlm_fsz;
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  im->md->write = 1;
+  memcpy(frm, dm->ptt_buf[idx], nvact * sizeof(double));
+  memcpy(frm + nvact, dm->cmd_buf[idx], nvact * sizeof(double));
+  frm[2 * nvact] = (double) dm->cmd_lat[idx].frame;
+  frm[2 * nvact + 1] = (double) now.tv_sec;
+  frm[2 * nvact + 2] = (double) now.tv_nsec;
+  im->md->writetime = now;
+  im->md->cnt1 = cnt % tlm_depth; // last frame written
+  __atomic_store_n(&im->md->cnt0, cnt + 1, __ATOMIC_RELEASE);
+  im->md->write = 0;
+  ImageStreamIO_sempost(im, -1);
+}
+
+/* =========================================================================
+ *   FITS header of a telemetry file holding nfrm frames (one FITS_BLOCK,
+ *   rewritten when the file is closed)
+ * ========================================================================= */
+void tlm_header(HEXDM *dm, uint64_t nfrm, char *hdr) {
+  char card[LINESIZE], line[LINESIZE];
+  int nc = 0;
+  auto add = [&](const char *key, const char *val) {
+    if (val == NULL)
+      snprintf(card, LINESIZE, "%s", key);
+    else if (val[0] == '\'') // strings start in column 11
+      snprintf(card, LINESIZE, "%-8s= %-20s", key, val);
+    else
+      snprintf(card, LINESIZE, "%-8s= %20s", key, val);
+    memset(hdr + nc, ' ', 80);
+    memcpy(hdr + nc, card, strnlen(card, 80));
+    nc += 80;
+  };
+
+  memset(hdr, ' ', FITS_BLOCK);
+  add("SIMPLE", "T");
+  add("BITPIX", "-64");
+  add("NAXIS", "3");
+  add("NAXIS1", std::to_string(ndof).c_str());
+  add("NAXIS2", std::to_string(tlm_nrow).c_str());
+  add("NAXIS3", std::to_string(nfrm).c_str());
+  add("DMSERIAL", ("'" + std::string(dm->serial) + "'").c_str());
+  snprintf(line, LINESIZE, "COMMENT rows 0-%d: combined PTT map, rows %d-%d: "
+	   "DM command", nseg - 1, nseg, 2 * nseg - 1);
+  add(line, NULL);
+  add("COMMENT last row: frame counter, time sent (CLOCK_REALTIME s, ns)", NULL);
+  add("END", NULL);
+}
+
+// appends the frames of the cube not saved yet to the file (if recording).
+// Called with tlm_mutex held.
+void tlm_save(HEXDM *dm) {
+  const double *cube = dm->tlm_im->array.D;
+  uint64_t head, nfrm, nbad, kk, ii, val;
+  ssize_t nbytes;
+
+  if (dm->tlm_fd < 0)
+    return;
+  head = __atomic_load_n(&dm->tlm_im->md->cnt0, __ATOMIC_ACQUIRE);
+  // the frame at head - tlm_depth may already be overwritten
+  if (head - dm->tlm_next > (uint64_t) tlm_depth - 1) {
+    dm->tlm_nlost += head - (tlm_depth - 1) - dm->tlm_next;
+    dm->tlm_next = head - (tlm_depth - 1);
+  }
+
+  while (dm->tlm_next < head) {
+    nfrm = head - dm->tlm_next;
+    nfrm = (nfrm > TLM_BATCH) ? TLM_BATCH : nfrm;
+    for (kk = 0; kk < nfrm; kk++)
+      memcpy(dm->tlm_buf + kk * tlm_fsz,
+	     cube + ((dm->tlm_next + kk) % tlm_depth) * tlm_fsz,
+	     tlm_fsz * sizeof(double));
+    // frames the driver thread started to overwrite during the copy
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    val = __atomic_load_n(&dm->tlm_im->md->cnt0, __ATOMIC_ACQUIRE);
+    nbad = (val > dm->tlm_next + tlm_depth - 1) ?
+      val - (dm->tlm_next + tlm_depth - 1) : 0;
+    nbad = (nbad > nfrm) ? nfrm : nbad;
+
+    for (ii = nbad * tlm_fsz; ii < nfrm * tlm_fsz; ii++) { // FITS: big-endian
+      memcpy(&val, &dm->tlm_buf[ii], sizeof(val));
+      val = __builtin_bswap64(val);
+      memcpy(&dm->tlm_buf[ii], &val, sizeof(val));
+    }
+    nbytes = (nfrm - nbad) * tlm_fsz * sizeof(double);
+    if (write(dm->tlm_fd, dm->tlm_buf + nbad * tlm_fsz, nbytes) != nbytes) {
+      printf("DM%d: telemetry write to %s failed (%s): recording stopped\n",
+	     dm->idm, dm->tlm_file, strerror(errno));
+      dm->tlm_nlost += nfrm - nbad;
+      dm->tlm_next += nfrm;
+      tlm_close(dm);
+      return;
+    }
+    dm->tlm_nlost += nbad;
+    dm->tlm_nsaved += nfrm - nbad;
+    dm->tlm_next += nfrm;
+  }
+}
+
+// saves the last frames, completes the FITS file and closes it. Called
+// with tlm_mutex held.
+void tlm_close(HEXDM *dm) {
+  char hdr[FITS_BLOCK];
+  off_t size;
+  int fd = dm->tlm_fd;
+
+  if (fd < 0)
+    return;
+  dm->tlm_fd = -1; // no more saving (tlm_save failure)
+  size = lseek(fd, 0, SEEK_END);
+  memset(hdr, 0, FITS_BLOCK);
+  if ((size > 0) && (size % FITS_BLOCK != 0)) // zero-padded data
+    if (write(fd, hdr, FITS_BLOCK - size % FITS_BLOCK) < 0)
+      printf("DM%d: failed to pad %s\n", dm->idm, dm->tlm_file);
+  tlm_header(dm, dm->tlm_nsaved, hdr);
+  if (pwrite(fd, hdr, FITS_BLOCK, 0) != FITS_BLOCK)
+    printf("DM%d: failed to update the header of %s\n", dm->idm, dm->tlm_file);
+  close(fd);
+}
+
+/* =========================================================================
+ *                     telemetry writer thread
+ *
+ * Saves the new frames of the telemetry cubes of all the DMs every TLM_POLL
+ * us, in batches of up to TLM_BATCH frames per write.
+ * ========================================================================= */
+void* tlm_writer(void *dummy) {
+  int kk;
+
+  (void) dummy;
+  while (keepgoing > 0) {
+    usleep(TLM_POLL);
+    for (kk = 0; kk < ndm; kk++) {
+      pthread_mutex_lock(&dms[kk].tlm_mutex);
+      tlm_save(&dms[kk]);
+      pthread_mutex_unlock(&dms[kk].tlm_mutex);
+    }
+  }
+  return NULL;
+}
+
+/* =========================================================================
+ *                     driver submission thread
+ *
+ * Sends the latest command published by the control loop to the DM, so
+ * that a slow driver call never holds the reading of the channels. The
+ * commands published while the driver is busy replace each other in the
+ * mailbox: only the most recent one gets sent.
+ *
+ * In synchronous mode, the driver threads of all the DMs wait for each
+ * other at the barrier before sending the command of the cycle.
+ * ========================================================================= */
+void* driver_loop(void *arg) {
+  HEXDM *dm = (HEXDM *) arg;
+  int ridx = 2, old;  // index of the cmd_buf owned by this thread
+  int sense = 0;      // phase of the synchronization barrier
+
+  while (keepgoing > 0) {
+    sem_wait(&dm->cmd_sem);
+    if ((__atomic_load_n(&dm->cmd_mbox, __ATOMIC_ACQUIRE) & CMD_FRESH) == 0)
+      continue; // already sent, or stop() request
+
+    old = __atomic_exchange_n(&dm->cmd_mbox, ridx, __ATOMIC_ACQ_REL);
+    ridx = old & ~CMD_FRESH;
+    if (sync_on) {
+      if (sync_barrier(&sense) != 0)
+	break;
+      dm->sync_t = lat_now();
+    }
+    if (driver_write(dm, dm->cmd_buf[ridx]) > 0)
+      __atomic_store_n(&dm->cmd_nsent, dm->cmd_nsent + 1, __ATOMIC_RELAXED);
+    if (dm->tlm_im != NULL)
+      tlm_push(dm, ridx);
+    if (__atomic_load_n(&dm->lat_reset, __ATOMIC_ACQUIRE) != dm->lat_gen) {
+      memset(dm->lat_hist, 0, LAT_NSTAMP * sizeof(LATHIST));
+      dm->lat_gen = dm->lat_reset;
+    }
+    if (__atomic_load_n(&lat_on, __ATOMIC_RELAXED) &&
+	(dm->cmd_lat[ridx].t[LAT_CONV] != 0)) {
+      dm->cmd_lat[ridx].t[LAT_SENT] = lat_now();
+      lat_record(dm, &dm->cmd_lat[ridx]);
+    }
+    if (sync_on)
+      sync_complete();
+  }
+  return NULL;
+}
+
+/* =========================================================================
+ *   maps a FITS sequence file for the playback: returns "" or the reason
+ *   why it cannot be played
+ * ========================================================================= */
+std::string play_map(PLAYBACK *pb, const char *fname) {
+  const char *card;
+  struct stat st;
+  size_t hsz = 0, kk;
+  long naxis = -1, nax[3] = {0, 0, 1};
+  int fd;
+
+  if ((fd = open(fname, O_RDONLY)) < 0)
+    return std::string("Failed to open ") + fname + ": " + strerror(errno);
+  fstat(fd, &st);
+  pb->size = st.st_size;
+  pb->map = (uint8_t *) mmap(NULL, pb->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (pb->map == MAP_FAILED) {
+    pb->map = NULL;
+    return std::string("Failed to map ") + fname;
+  }
+  madvise(pb->map, pb->size, MADV_SEQUENTIAL);
+
+  pb->bitpix = 0;
+  for (kk = 0; (hsz == 0) && (kk + 80 <= pb->size); kk += 80) {
+    card = (const char *) pb->map + kk;
+    if (strncmp(card, "END     ", 8) == 0)
+      hsz = (kk / FITS_BLOCK + 1) * FITS_BLOCK;
+    else if (strncmp(card, "BITPIX  =", 9) == 0)
+      pb->bitpix = atoi(card + 10);
+    else if (strncmp(card, "NAXIS   =", 9) == 0)
+      naxis = atol(card + 10);
+    else if ((strncmp(card, "NAXIS", 5) == 0) && (card[5] >= '1') &&
+	     (card[5] <= '3') && (card[6] == ' '))
+      nax[card[5] - '1'] = atol(card + 10);
+  }
+  pb->stride = nax[0] * nax[1];
+  pb->nfrm = nax[2];
+  pb->data = pb->map + hsz;
+  if ((hsz == 0) || ((pb->bitpix != -64) && (pb->bitpix != -32)) ||
+      ((naxis != 2) && (naxis != 3)) || (nax[0] != ndof) || (nax[1] < nseg))
+    return std::string(fname) + " is not a FITS cube of float or double "
+      "frames of 3 x 169 values (or more rows)";
+  if (hsz + pb->nfrm * pb->stride * (-pb->bitpix / 8) > pb->size)
+    return std::string(fname) + " is truncated";
+  play_ahead(pb, 0);
+  return "";
+}
+
+// writes frame #kk of the sequence into the play channel
+void play_frame(PLAYBACK *pb, uint64_t kk) {
+  IMAGE *im = &pb->chan->im;
+  size_t esz = -pb->bitpix / 8;
+  const uint8_t *src = pb->data + kk * pb->stride * esz;
+  uint64_t v64;
+  uint32_t v32;
+  double val;
+  float fval;
+  int ii;
+
+  im->md->write = 1;
+  for (ii = 0; ii < nvact; ii++) { // FITS: big-endian
+    if (esz == sizeof(double)) {
+      memcpy(&v64, src + ii * esz, esz);
+      v64 = __builtin_bswap64(v64);
+      memcpy(&val, &v64, esz);
+    }
+    else {
+      memcpy(&v32, src + ii * esz, esz);
+      v32 = __builtin_bswap32(v32);
+      memcpy(&fval, &v32, esz);
+      val = fval;
+    }
+    if (chan_type == _DATATYPE_FLOAT)
+      im->array.F[ii] = (float) val;
+    else
+      im->array.D[ii] = val;
+  }
+  clock_gettime(CLOCK_REALTIME, &im->md->writetime);
+  im->md->cnt0++;
+  im->md->write = 0;
+  ImageStreamIO_sempost(im, -1);
+}
+
+// asks the kernel to read the frames [k0, k0 + PLAY_AHEAD[ of the sequence
+void play_ahead(PLAYBACK *pb, uint64_t k0) {
+  size_t fsz = pb->stride * (-pb->bitpix / 8);
+  uintptr_t pgsz = getpagesize();
+  uint64_t k1 = (k0 + PLAY_AHEAD < pb->nfrm) ? k0 + PLAY_AHEAD : pb->nfrm;
+  uintptr_t addr, stop;
+
+  if (k0 >= pb->nfrm)
+    return;
+  addr = (uintptr_t) (pb->data + k0 * fsz);
+  stop = (uintptr_t) (pb->data + k1 * fsz);
+  madvise((void *) (addr & ~(pgsz - 1)), stop - (addr & ~(pgsz - 1)),
+	  MADV_WILLNEED);
+}
+
+// hands back the semaphore index of the trigger stream (semReadPID), once
+// the playback is over: the next playback claims a new one
+void play_trig_release(PLAYBACK *pb) {
+  if (pb->semidx < 0)
+    return;
+  pb->trig.semReadPID[pb->semidx] = 0;
+  pb->semidx = -1;
+}
+
+// waits for the next update of the trigger stream (100 ms timeouts to
+// check the running flag): returns 0, or -1 if the playback was stopped.
+// late: time since the trigger was written
+int play_trigger_wait(PLAYBACK *pb, uint64_t *cnt, int64_t *late) {
+  struct timespec tout;
+  uint64_t val;
+
+  while (__atomic_load_n(&pb->running, __ATOMIC_ACQUIRE)) {
+    clock_gettime(CLOCK_REALTIME, &tout);
+    tout.tv_nsec += 100000000;
+    if (tout.tv_nsec >= 1000000000) {
+      tout.tv_sec++;
+      tout.tv_nsec -= 1000000000;
+    }
+    if (ImageStreamIO_semtimedwait(&pb->trig, pb->semidx, &tout) != 0)
+      continue;
+    val = __atomic_load_n(&pb->trig.md->cnt0, __ATOMIC_ACQUIRE);
+    if (val == *cnt) // already served
+      continue;
+    if (val - *cnt > 1) // updates received while the last frame was written
+      __atomic_store_n(&pb->nmiss, pb->nmiss + val - *cnt - 1,
+		       __ATOMIC_RELAXED);
+    *cnt = val;
+    *late = lat_now() - lat_ts(&pb->trig.md->writetime);
+    return 0;
+  }
+  return -1;
+}
+
+// lateness of a frame: histogram shared with the latency measurements
+void play_record(PLAYBACK *pb, int64_t late) {
+  late = (late > 0) ? late : 0;
+  __atomic_store_n(&pb->hist.bin[lat_bin(late)], pb->hist.bin[lat_bin(late)] + 1,
+		   __ATOMIC_RELAXED);
+  __atomic_store_n(&pb->hist.count, pb->hist.count + 1, __ATOMIC_RELAXED);
+  if (late > pb->hist.vmax)
+    __atomic_store_n(&pb->hist.vmax, late, __ATOMIC_RELAXED);
+}
+
+/* =========================================================================
+ *                         sequence playback thread
+ *
+ * Plays every frame of the sequence in turn. At a fixed rate, frame #kk is
+ * due kk periods after the start (absolute deadlines): the lateness of the
+ * frames is recorded, and a frame that comes a full period late or more
+ * counts as a missed deadline, the following ones being due a period after
+ * it. With a trigger stream, a frame is played on each update of the
+ * trigger (lateness: from the write time of the trigger), the updates
+ * received while a frame is written count as missed. The channel is reset
+ * at the end of the sequence.
+ * ========================================================================= */
+void* play_loop(void *arg) {
+  HEXDM *dm = (HEXDM *) arg;
+  PLAYBACK *pb = dm->play;
+  IMAGE *im = &pb->chan->im;
+  struct timespec next;
+  int64_t period = 0, t_next, late = 0;
+  uint64_t kk, cnt = 0;
+
+  prctl(PR_SET_TIMERSLACK, 1); // wake up on time (50 us slack by default)
+  if (pb->rate > 0)
+    period = (int64_t) (1e9 / pb->rate);
+  else
+    cnt = __atomic_load_n(&pb->trig.md->cnt0, __ATOMIC_ACQUIRE);
+  t_next = mono_now() + period;
+
+  for (kk = 0; kk < pb->nfrm; kk++) {
+    if (kk % PLAY_AHEAD == 0) // next pages of the file, before they're due
+      play_ahead(pb, kk + PLAY_AHEAD);
+
+    if (period > 0) {
+      next.tv_sec = t_next / 1000000000;
+      next.tv_nsec = t_next % 1000000000;
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) ==
+	     EINTR);
+      late = mono_now() - t_next;
+      if (late >= period) { // missed: the next frames are due after this one
+	__atomic_store_n(&pb->nmiss, pb->nmiss + 1, __ATOMIC_RELAXED);
+	t_next += (late / period) * period;
+      }
+      t_next += period;
+    }
+    else if (play_trigger_wait(pb, &cnt, &late) != 0)
+      break;
+    if (!__atomic_load_n(&pb->running, __ATOMIC_ACQUIRE))
+      break;
+    play_frame(pb, kk);
+    play_record(pb, late);
+    __atomic_store_n(&pb->nplayed, pb->nplayed + 1, __ATOMIC_RELAXED);
+  }
+
+  im->md->write = 1; // end of the sequence: the channel is reset
+  memset(im->array.raw, 0, im->md->nelement * chan_esz);
+  im->md->cnt0++;
+  im->md->write = 0;
+  ImageStreamIO_sempost(im, -1);
+  play_trig_release(pb);
+  __atomic_store_n(&pb->running, 0, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+// stops the playback thread of the DM (if any) and unmaps the sequence.
+// The statistics are kept.
+void play_halt(HEXDM *dm) {
+  PLAYBACK *pb = dm->play;
+
+  if ((pb == NULL) || (pb->map == NULL))
+    return;
+  if (pb->chan != NULL) {
+    __atomic_store_n(&pb->running, 0, __ATOMIC_RELEASE);
+    pthread_join(pb->tid, NULL);
+    pb->chan = NULL;
+  }
+  if (pb->trig_name[0] != '\0') {
+    play_trig_release(pb); // (thread never started)
+    ImageStreamIO_closeIm(&pb->trig);
+  }
+  munmap(pb->map, pb->size);
+  pb->map = NULL;
+}
+
+/* =========================================================================
+ *            Functions registered with the commander server
+ * ========================================================================= */
+
+void start() {
+  /* -------------------------------------------------------------------------
+   *    Starts the monitoring of shared memory data structures (all DMs)
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm;
+  int ii, kk;
+
+  if (keepgoing == 0) {
+    keepgoing = 1; // raise the flag
+    printf("DM control loop START%s\n", sync_on ? " (synchronous DMs)" : "");
+    sync_count = 0;
+    sync_sense = 0;
+    sync_ndone = 0;
+    while (sem_trywait(&sync_sem) == 0);
+    while (sem_trywait(&sync_done_sem) == 0);
+    for (kk = 0; kk < ndm; kk++) {
+      dm = &dms[kk];
+      dm->cmd_mbox = 1;  // cmd_buf #0 for the loop, #2 for the driver thread
+      dm->dac_known = 0; // the first command is sent in full
+      while (sem_trywait(&dm->cmd_sem) == 0);
+      if (sync_on) { // the loop only runs in the cycles
+	while (sem_trywait(&dm->dm_update_sem) == 0);
+	dm->dm_refresh = 0;
+      }
+      pthread_create(&dm->tid_drv, NULL, driver_loop, dm);
+      pthread_create(&dm->tid_loop, NULL, dm_control_loop, dm);
+      for (ii = 0; ii < dm->chans->nuse; ii++)
+	chan_watch_start(dm->chans->chan[dm->chans->use[ii]]);
+    }
+    if (sync_on) {
+      pthread_create(&tid_sync, NULL, sync_loop, NULL);
+      sem_post(&sync_sem); // first cycle: sends the current commands
+    }
+    if (tlm_depth > 0)
+      pthread_create(&tid_tlm, NULL, tlm_writer, NULL);
+    printf("%s\n", rt_apply().c_str());
+  }
+  else
+    printf("DM control loop already running!\n");
+  sprintf(drv_status, "%s", "running");
+}
+
+std::string rt_apply() {
+  /* -------------------------------------------------------------------------
+   *   Applies the real-time settings to the running threads and reports
+   *   what is actually in effect
+   * ------------------------------------------------------------------------- */
+  std::string res;
+  int err, ii, kk;
+  CHANNEL *ch;
+  HEXDM *dm;
+
+  if (keepgoing == 0)
+    return "DM control loop not running: settings applied at start";
+
+  for (kk = 0; kk < ndm; kk++) {
+    dm = &dms[kk];
+    if ((err = thread_rt_apply(dm->tid_loop, dm->loop_cpu)) != 0)
+      res += "DM" + std::to_string(dm->idm) + " control loop settings failed: "
+	+ strerror(err) + "\n";
+    if ((err = thread_rt_apply(dm->tid_drv, dm->drv_cpu)) != 0)
+      res += "DM" + std::to_string(dm->idm) + " driver thread settings failed: "
+	+ strerror(err) + "\n";
+    for (ii = 0; ii < dm->chans->nuse; ii++) { // same scheduling, no pinning
+      ch = dm->chans->chan[dm->chans->use[ii]];
+      if (ch->watched) // (no watcher without a free semaphore)
+	thread_rt_apply(ch->tid, -1);
+    }
+    if ((dm->play != NULL) && (dm->play->chan != NULL)) // not joined yet
+      thread_rt_apply(dm->play->tid, -1);
+  }
+  if (sync_on)
+    thread_rt_apply(tid_sync, -1);
+  // the telemetry writer keeps the default policy on purpose: the cube depth
+  // absorbs its delays (frames overwritten meanwhile are counted as lost),
+  // while at a real-time priority its copies to the file would compete with
+  // the DM threads for the CPUs.
+  return res + rt_report();
+}
+
+std::string rt_report() {
+  /* -------------------------------------------------------------------------
+   *     Reports the settings in effect for the threads of all the DMs
+   * ------------------------------------------------------------------------- */
+  std::string res = mem_lock ? "memory locked\n" : "memory not locked\n";
+  char name[LINESIZE];
+  HEXDM *dm;
+
+  for (int kk = 0; kk < ndm; kk++) {
+    dm = &dms[kk];
+    snprintf(name, LINESIZE, "DM%d control loop", dm->idm);
+    res += thread_rt_report(dm->tid_loop, name) + "\n";
+    snprintf(name, LINESIZE, "DM%d driver thread", dm->idm);
+    res += thread_rt_report(dm->tid_drv, name);
+    if (kk < ndm - 1)
+      res += "\n";
+  }
+  return res;
+}
+
+void stop() {
+  /* -------------------------------------------------------------------------
+   *     Stops the monitoring of shared memory data structures (all DMs)
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm;
+  int ii, kk;
+
+  if (keepgoing == 1) {
+    keepgoing = 0;
+    if (sync_on) {
+      sem_post(&sync_sem);      // unblock the synchronous cycles
+      sem_post(&sync_done_sem);
+      pthread_join(tid_sync, NULL);
+    }
+    for (kk = 0; kk < ndm; kk++) {
+      dm = &dms[kk];
+      sem_post(&dm->dm_update_sem); // unblock the control loop
+      pthread_join(dm->tid_loop, NULL);
+      for (ii = 0; ii < dm->chans->nuse; ii++)
+	chan_watch_stop(dm->chans->chan[dm->chans->use[ii]]);
+      sem_post(&dm->cmd_sem);       // unblock the driver thread
+      pthread_join(dm->tid_drv, NULL);
+    }
+    if (tlm_depth > 0) {
+      pthread_join(tid_tlm, NULL);
+      for (kk = 0; kk < ndm; kk++) { // frames sent since its last pass
+	pthread_mutex_lock(&dms[kk].tlm_mutex);
+	tlm_save(&dms[kk]);
+	pthread_mutex_unlock(&dms[kk].tlm_mutex);
+      }
+    }
+  }
+  else
+    printf("DM control loop already off\n");
+  sprintf(drv_status, "%s", "idle");
+}
+
+std::string status() {
+  /* -------------------------------------------------------------------------
+   *                          Returns server status
+   * ------------------------------------------------------------------------- */
+  return drv_status;
+}
+
+int get_ndm() {
+  /* -------------------------------------------------------------------------
+   *               Returns the number of DMs driven by the server
+   * ------------------------------------------------------------------------- */
+  return ndm;
+}
+
+std::string get_serial(int idm) {
+  /* -------------------------------------------------------------------------
+   *                    Returns the identifier of DM #idm
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  return std::string(dm->serial) + " (shm: " + dm->prefix + "pttNN, " +
+    dm->prefix + "actNN, " + dm->prefix + "dmvolt" +
+    ((dm->chans->chan[PLAY0] != NULL) ? ", " + std::string(dm->prefix) +
+     "play" : "") +
+    ((dm->tlm_im != NULL) ? ", " +
+			    std::string(dm->prefix) + "ptt_tlm)" : ")");
+}
+
+int get_nch(int idm) {
+  /* -------------------------------------------------------------------------
+   *            Returns the number of virtual channels of DM #idm
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+
+  if (dm == NULL) {
+    printf("%s\n", dm_unknown(idm).c_str());
+    return -1;
+  }
+  return dm->chans->nch;
+}
+
+void set_nch(int idm, int ival) {
+  /* -------------------------------------------------------------------------
+   *   Updates the number of virtual channels of DM #idm: the existing
+   *   channels are kept, even while the loop runs
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+  std::string err;
+
+  if (dm == NULL) {
+    printf("%s\n", dm_unknown(idm).c_str());
+    return;
+  }
+  if ((err = chan_table_set(dm, ival, dm->chans->nact, dm->chans->chan[MODE0],
+			    dm->chans->chan[PLAY0])) != "") {
+    printf("%s\n", err.c_str());
+    return;
+  }
+  printf("Success: # channels = %d\n", ival);
+}
+
+int get_nact(int idm) {
+  /* -------------------------------------------------------------------------
+   *          Returns the number of actuator channels of DM #idm
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+
+  if (dm == NULL) {
+    printf("%s\n", dm_unknown(idm).c_str());
+    return -1;
+  }
+  return dm->chans->nact;
+}
+
+std::string set_nact(int idm, int ival) {
+  /* -------------------------------------------------------------------------
+   *   Updates the number of actuator channels of DM #idm (0 for none),
+   *   even while the loop runs
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+  std::string err;
+  char msg[LINESIZE];
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  if ((err = chan_table_set(dm, dm->chans->nch, ival, dm->chans->chan[MODE0],
+			    dm->chans->chan[PLAY0])) != "")
+    return err;
+  snprintf(msg, LINESIZE, "Success: # actuator channels = %d", ival);
+  return msg;
+}
+
+void reset(int idm, int channel) {
+  /* -------------------------------------------------------------------------
+   *   Resets a channel of DM #idm, or all its PTT and actuator channels
+   *   (-1): the modal and play channels are left to their own clients
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+  IMAGE *im;
+  char msg[LINESIZE];
+  int kk, k0, k1;
+
+  if (dm == NULL) {
+    printf("%s\n", dm_unknown(idm).c_str());
+    return;
+  }
+  if ((channel >= 0) && (chan_lookup(dm, channel, msg) == NULL)) {
+    printf("%s\n", msg);
+    return;
+  }
+  k0 = (channel < 0) ? 0 : channel;
+  k1 = (channel < 0) ? MODE0 : channel + 1;
+  for (kk = k0; kk < k1; kk++) {
+    if (dm->chans->chan[kk] == NULL)
+      continue;
+    im = &dm->chans->chan[kk]->im;
+    im->md->write = 1;           // signaling about to write
+    memset(im->array.raw, 0, im->md->nelement * chan_esz);
+    im->md->cnt0++;
+    ImageStreamIO_sempost(im, -1);
+    im->md->write = 0;   // done writing
+  }
+}
+
+std::string set_gain(int idm, int channel, double gain) {
+  /* -------------------------------------------------------------------------
+   *   Sets the gain applied to channel #channel of DM #idm (all if -1),
+   *   numbered as in chan_lookup
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+  char msg[LINESIZE];
+  int jj;
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  if ((channel >= 0) && (chan_lookup(dm, channel, msg) == NULL))
+    return msg;
+  for (jj = 0; jj < dm->chans->nuse; jj++)
+    if ((channel < 0) || (dm->chans->use[jj] == channel))
+      __atomic_store(&dm->chans->chan[dm->chans->use[jj]]->gain, &gain,
+		     __ATOMIC_RELAXED);
+  chan_settings_publish(dm, 0);
+  snprintf(msg, LINESIZE, "Gain of DM #%d channel %d = %g", idm, channel, gain);
+  return msg;
+}
+
+std::string set_mute(int idm, int channel, int muted) {
+  HEXDM *dm = dm_get(idm);
+  char msg[LINESIZE];
+  int jj;
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  if ((channel >= 0) && (chan_lookup(dm, channel, msg) == NULL))
+    return msg;
+  for (jj = 0; jj < dm->chans->nuse; jj++)
+    if ((channel < 0) || (dm->chans->use[jj] == channel))
+      __atomic_store_n(&dm->chans->chan[dm->chans->use[jj]]->muted, muted,
+		       __ATOMIC_RELAXED);
+  chan_settings_publish(dm, 0);
+  snprintf(msg, LINESIZE, "DM #%d channel %d %s", idm, channel,
+	   muted ? "muted" : "enabled");
+  return msg;
+}
+
+std::string mute(int idm, int channel) {
+  /* -------------------------------------------------------------------------
+   *   Leaves channel #channel of DM #idm (all if -1) out of the sum: the
+   *   channel is no longer read
+   * ------------------------------------------------------------------------- */
+  return set_mute(idm, channel, 1);
+}
+
+std::string unmute(int idm, int channel) {
+  /* -------------------------------------------------------------------------
+   *          Adds channel #channel of DM #idm (all if -1) to the sum again
+   * ------------------------------------------------------------------------- */
+  return set_mute(idm, channel, 0);
+}
+
+std::string load_weight(int idm, int channel, std::string fname) {
+  /* -------------------------------------------------------------------------
+   *   Loads the weights of the elements of channel #channel of DM #idm
+   *   (nvact values, in the order of the channel, applied before the PTT
+   *   -> actuator projection), or removes them ("none")
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+  CHANNEL *ch;
+  double *wgt = NULL, *old;
+  int err;
+  char msg[LINESIZE];
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  if ((ch = chan_lookup(dm, channel, msg)) == NULL)
+    return msg;
+  if (channel == MODE0)
+    return "The modal channel takes no weights (see load_modes)";
+  if ((fname != "none") &&
+      ((err = load_weight_map(fname.c_str(), &wgt)) != 0)) {
+    if (err == -1)
+      return "Failed to read the weights in " + fname;
+    return "Weights file " + fname + " must hold "
+      + std::to_string(nvact) + " values";
+  }
+
+  old = ch->weight;
+  __atomic_store_n(&ch->weight, wgt, __ATOMIC_RELEASE);
+  chan_settings_publish(dm, 1); // old weights no longer in use after this
+  free(old);
+  return "Weights " + fname + " loaded for DM #" + std::to_string(idm)
+    + " channel " + std::to_string(channel);
+}
+
+std::string chan_status(int idm) {
+  /* -------------------------------------------------------------------------
+   *   Returns the number, gain, state and weights of the channels of DM #idm
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+  std::string res;
+  CHANNEL *ch;
+  const double *wgt;
+  char msg[LINESIZE];
+  int jj, kk, muted;
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  for (jj = 0; jj < dm->chans->nuse; jj++) {
+    kk = dm->chans->use[jj];
+    ch = dm->chans->chan[kk];
+    muted = __atomic_load_n(&ch->muted, __ATOMIC_RELAXED);
+    wgt = __atomic_load_n(&ch->weight, __ATOMIC_ACQUIRE);
+    snprintf(msg, LINESIZE, "ch %02d (%s): gain = %g - %s%s",
+	     kk, ch->im.md->name, chan_gain(ch), muted ? "muted" : "enabled",
+	     (wgt != NULL) ? " - weighted" : "");
+    res += (jj ? "\n" : "") + std::string(msg);
+    if (kk == MODE0)
+      res += " - " + std::to_string(ch->nmode) + " modes ("
+	+ dm->modes_file + ")";
+  }
+  return res;
+}
+
+std::string load_modes(int idm, std::string fname) {
+  /* -------------------------------------------------------------------------
+   *   Loads the mode -> PTT basis of the modal channel of DM #idm, which is
+   *   (re)created with one coefficient per mode ("none" removes it). With
+   *   the same # of modes, only the basis is swapped, which is safe while
+   *   the loop runs. A different # of modes means a new modes shm under the
+   *   same name, which clients may still have mapped: only allowed while
+   *   the loop is stopped (or after "none").
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+  CHANNEL *modal = NULL;
+  double *basis = NULL, *old;
+  int nmode = 0;
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  if (fname != "none") {
+    if ((nmode = load_modes_basis(fname.c_str(), &basis)) < 0)
+      return "Failed to read up to " + std::to_string(MODE_MAX) + " modes of "
+	+ std::to_string(nvact) + " values from " + fname;
+  }
+
+  modal = dm->chans->chan[MODE0];
+  if ((keepgoing == 1) && (modal != NULL) && (basis != NULL) &&
+      (modal->nmode != nmode)) {
+    free(basis);
+    return "Cannot change the # of modes (" + std::to_string(modal->nmode)
+      + " -> " + std::to_string(nmode) + ") while the loop runs: stop it,"
+      " or load_modes none first";
+  }
+  if ((modal != NULL) && (basis != NULL) && (modal->nmode == nmode)) {
+    old = modal->basis;    // same shm: new basis, picked up by a re-sum
+    __atomic_store_n(&modal->basis, basis, __ATOMIC_RELEASE);
+    chan_settings_publish(dm, 1); // old basis no longer in use after this
+    free(old);
+  }
+  else {
+    if (modal != NULL) // removed first: the new one reuses its shm name
+      chan_table_set(dm, dm->chans->nch, dm->chans->nact, NULL,
+		     dm->chans->chan[PLAY0]);
+    if (basis != NULL) {
+      modal = chan_create(dm, MODE0, nmode);
+      modal->basis = basis;
+      chan_table_set(dm, dm->chans->nch, dm->chans->nact, modal,
+		     dm->chans->chan[PLAY0]);
+    }
+  }
+  snprintf(dm->modes_file, LINESIZE, "%s", fname.c_str());
+  return std::string("Modal basis ") + dm->modes_file + " loaded ("
+    + std::to_string(nmode) + " modes)";
+}
+
+std::string kernel_bench(int niter) {
+  /* -------------------------------------------------------------------------
+   *   Times the reference and the selected PTT -> actuator conversion kernel
+   *   (with a copy of the conversion table and combined map of DM #1), and
+   *   the reading and accumulation of one double and one float channel
+   * ------------------------------------------------------------------------- */
+  struct timespec t0, t1;
+  double dt_ref, dt_ker, dt_dbl, dt_flt;
+  double *res = alloc_aligned(csz);
+  double *src = alloc_aligned(nvact);
+  double *snap = alloc_aligned(nvact);
+  double *prev = alloc_aligned(nvact);
+  double *sum = alloc_aligned(nvact);
+  double *ptt = alloc_aligned(nvpad + 2 * MAPPAD) + MAPPAD;
+  double *band = alloc_aligned(band_size);
+  CONVTAB cv = {band, alloc_aligned(tab_size), 0};
+  const CONVTAB *coef;
+  char msg[LINESIZE];
+  HEXDM *dm = &dms[0];
+  int ii;
+
+  if (niter <= 0) niter = 100000;
+
+  // private copies: the loop keeps updating comb_map, and a load_calib can
+  // free the band matrix in use (act_coef_acquire is the loop's own: the
+  // copy is made with calib_mutex held, which keeps the table published)
+  pthread_mutex_lock(&calib_mutex);
+  coef = __atomic_load_n(&dm->act_coef, __ATOMIC_SEQ_CST);
+  memcpy(band, coef->band, band_size * sizeof(double));
+  memcpy(cv.tab, coef->tab, tab_size * sizeof(double));
+  pthread_mutex_unlock(&calib_mutex);
+  memcpy(ptt, dm->comb_map, nvact * sizeof(double));
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (ii = 0; ii < niter; ii++)
+    ptt_2_actuator(ptt, res);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  dt_ref = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / niter;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (ii = 0; ii < niter; ii++)
+    ptt_2_actuator_kernel(&cv, ptt, NULL, res);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  dt_ker = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / niter;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (ii = 0; ii < niter; ii++) {
+    memcpy(snap, src, nvact * sizeof(double));
+    chan_accum_kernel<double>(snap, NULL, 1.0, prev, sum, 0);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  dt_dbl = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / niter;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (ii = 0; ii < niter; ii++) {
+    memcpy(snap, src, nvact * sizeof(float));
+    chan_accum_kernel<float>((float *) snap, NULL, 1.0, prev, sum, 0);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  dt_flt = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / niter;
+
+  free(res);
+  free(src);
+  free(snap);
+  free(prev);
+  free(sum);
+  free(ptt - MAPPAD);
+  free(band);
+  free(cv.tab);
+  snprintf(msg, LINESIZE, "reference: %.1f ns - %s: %.1f ns (x %.1f)\n"
+	   "channel read + sum: double %.1f ns - float %.1f ns",
+	   dt_ref, kernel_name, dt_ker, dt_ref / dt_ker, dt_dbl, dt_flt);
+  return msg;
+}
+
+std::string kernel_check() {
+  /* -------------------------------------------------------------------------
+   *   Checks every PTT -> actuator kernel the CPU supports (not only the
+   *   selected one) against the reference ptt_2_actuator(), with a random
+   *   PTT map, flat, actuator map and limits: commands and # of clipped
+   *   actuators over the nvpad values, padding (nvact..nvpad) included
+   * ------------------------------------------------------------------------- */
+  typedef int (*KERNEL)(const CONVTAB*, const double*, const double*, double*);
+  const char *names[3] = {"scalar", "avx2", "avx512"};
+  KERNEL kerns[3] = {ptt_2_actuator_scalar, ptt_2_actuator_avx2,
+		     ptt_2_actuator_avx512};
+  int avail[3] = {1, 0, 0};
+  double *ptt = alloc_aligned(nvpad + 2 * MAPPAD) + MAPPAD;
+  double *act = alloc_aligned(nvpad);
+  double *ref = alloc_aligned(csz);
+  double *res = alloc_aligned(csz);
+  double *band = alloc_aligned(band_size);
+  CONVTAB cv = {band, alloc_aligned(tab_size), 0};
+  double *flat = cv.tab + flat_off, *lo = cv.tab + lo_off, *hi = cv.tab + hi_off;
+  double mats[nseg * 9];
+  double err, amax = 0.0, val;
+  int ii, kk, nclip, nref = 0;
+  std::string out;
+  char msg[LINESIZE];
+
+  __builtin_cpu_init();
+  avail[1] = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  avail[2] = __builtin_cpu_supports("avx512f");
+
+  srand(2);
+  for (ii = 0; ii < nseg; ii++) {
+    ptt[ii*ndof]   = 2000.0 * (rand() / (double) RAND_MAX - 0.5);  // nm
+    ptt[ii*ndof+1] = 2.0 * (rand() / (double) RAND_MAX - 0.5);     // mrad
+    ptt[ii*ndof+2] = 2.0 * (rand() / (double) RAND_MAX - 0.5);     // mrad
+  }
+  for (ii = 0; ii < nvact; ii++)
+    act[ii] = 0.1 * (rand() / (double) RAND_MAX - 0.5);
+  for (ii = 0; ii < csz; ii++) { // flat & limits up to csz: padding included
+    flat[ii] = 0.5 + 0.2 * (rand() / (double) RAND_MAX - 0.5);
+    lo[ii] = 0.4;
+    hi[ii] = 0.6;
+  }
+  ideal_matrices(mats);
+  act_coef_fill(band, mats);
+
+  ptt_2_actuator(ptt, ref); // expected: clip(flat + ptt_2_actuator + act)
+  for (ii = 0; ii < nvpad; ii++) {
+    val = flat[ii] + ((ii < nvact) ? ref[ii] + act[ii] : 0.0);
+    nref += (val < lo[ii]) || (val > hi[ii]);
+    ref[ii] = fmin(fmax(val, lo[ii]), hi[ii]);
+    amax = fmax(amax, fabs(ref[ii]));
+  }
+
+  for (kk = 0; kk < 3; kk++) {
+    if (!avail[kk]) {
+      out += std::string((kk > 0) ? "\n" : "") + names[kk]
+	+ ": not supported by the CPU";
+      continue;
+    }
+    nclip = kerns[kk](&cv, ptt, act, res);
+    err = 0.0;
+    for (ii = 0; ii < nvpad; ii++)
+      err = fmax(err, fabs(res[ii] - ref[ii]));
+    snprintf(msg, LINESIZE, "%s%s: max rel. error = %.2e - clipped %d / %d - %s",
+	     (kk > 0) ? "\n" : "", names[kk], err / amax, nclip, nref,
+	     ((err <= KERN_TOL * amax) && (nclip == nref)) ? "OK" : "FAILED");
+    out += msg;
+  }
+
+  free(ptt - MAPPAD);
+  free(act);
+  free(ref);
+  free(res);
+  free(band);
+  free(cv.tab);
+  return out;
+}
+
+std::string get_dtype() {
+  /* -------------------------------------------------------------------------
+   *                 Returns the datatype of the channels
+   * ------------------------------------------------------------------------- */
+  return (chan_type == _DATATYPE_FLOAT) ? "float" : "double";
+}
+
+std::string load_calib(int idm, std::string fname) {
+  /* -------------------------------------------------------------------------
+   *   Loads per-segment PTT -> actuator matrices of DM #idm from a
+   *   calibration file ("ideal" restores the nominal geometry). Safe while
+   *   the loop runs.
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+  double mats[nseg * 9];
+  const double *band;
+  char msg[LINESIZE];
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  if (fname == "ideal")
+    ideal_matrices(mats);
+  else if (load_matrices(fname.c_str(), mats) != 0)
+    return "Failed to read " + std::to_string(9 * nseg) + " values from "
+      + fname;
+  if ((band = calib_share(mats)) == NULL) {
+    snprintf(msg, LINESIZE, "Too many calibrations loaded (max %d)", MAX_CALIB);
+    return msg;
+  }
+
+  act_coef_publish(dm, band, NULL, NULL);
+  snprintf(dm->calib_file, LINESIZE, "%s", fname.c_str());
+  return std::string("Calibration ") + dm->calib_file + " loaded";
+}
+
+std::string get_calib(int idm) {
+  /* -------------------------------------------------------------------------
+   *    Returns the origin of the PTT -> actuator matrix in use for DM #idm
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  return dm->calib_file;
+}
+
+std::string load_flat(int idm, std::string fname) {
+  /* -------------------------------------------------------------------------
+   *   Loads the flat map added to the command of DM #idm ("none" for no
+   *   flat). Safe while the loop runs: the switch happens between two updates.
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+  double flat[csz];
+  int nval = 0;
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  if (fname == "none")
+    memset(flat, 0, csz * sizeof(double));
+  else if ((nval = load_flat_map(fname.c_str(), flat)) < nvact)
+    return "Failed to read at least " + std::to_string(nvact)
+      + " values from " + fname;
+
+  act_coef_publish(dm, NULL, flat, NULL);
+  snprintf(dm->flat_file, LINESIZE, "%s", fname.c_str());
+  return std::string("Flat ") + dm->flat_file + " loaded ("
+    + std::to_string(nval) + " values)";
+}
+
+std::string get_flat(int idm) {
+  /* -------------------------------------------------------------------------
+   *             Returns the origin of the flat map in use for DM #idm
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  return dm->flat_file;
+}
+
+std::string load_limits(int idm, std::string fname) {
+  /* -------------------------------------------------------------------------
+   *   Loads the per-actuator command limits of DM #idm ("default" for [0, 1]
+   *   range). Safe while the loop runs: the switch happens between two updates.
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+  double lims[2 * csz];
+  int nval = csz;
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  if (fname == "default")
+    default_cmd_limits(lims);
+  else if ((nval = load_cmd_limits(fname.c_str(), lims)) < nvact)
+    return "Failed to read at least " + std::to_string(nvact)
+      + " limits from " + fname;
+
+  act_coef_publish(dm, NULL, NULL, lims);
+  snprintf(dm->lim_file, LINESIZE, "%s", fname.c_str());
+  return std::string("Limits ") + dm->lim_file + " loaded ("
+    + std::to_string(nval) + " actuators)";
+}
+
+std::string get_limits(int idm) {
+  /* -------------------------------------------------------------------------
+   *        Returns the origin of the command limits in use for DM #idm
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  return dm->lim_file;
+}
+
+std::string clip_stats(int idm) {
+  /* -------------------------------------------------------------------------
+   *       Returns the statistics of the clipped actuators of DM #idm
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+  char msg[LINESIZE];
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  snprintf(msg, LINESIZE,
+	   "last: %lu - max: %lu - clipped cmds: %lu / %lu - total clips: %lu",
+	   (unsigned long) __atomic_load_n(&dm->clip_last, __ATOMIC_RELAXED),
+	   (unsigned long) __atomic_load_n(&dm->clip_max, __ATOMIC_RELAXED),
+	   (unsigned long) __atomic_load_n(&dm->clip_nfrm, __ATOMIC_RELAXED),
+	   (unsigned long) __atomic_load_n(&dm->nframes, __ATOMIC_RELAXED),
+	   (unsigned long) __atomic_load_n(&dm->clip_tot, __ATOMIC_RELAXED));
+  return msg;
+}
+
+std::string get_driver(int idm) {
+  /* -------------------------------------------------------------------------
+   *   Returns the driver backend in use (and simulation details) for DM #idm
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+  char msg[LINESIZE];
+  int nc;
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  nc = snprintf(msg, LINESIZE, "%s - %lu commands sent (%lu partial) - "
+		"%lu dropped - %lu unchanged", drv->name,
+		(unsigned long) __atomic_load_n(&dm->cmd_nsent, __ATOMIC_RELAXED),
+		(unsigned long) __atomic_load_n(&dm->cmd_npart, __ATOMIC_RELAXED),
+		(unsigned long) __atomic_load_n(&dm->cmd_ndrop, __ATOMIC_RELAXED),
+		(unsigned long) __atomic_load_n(&dm->cmd_nskip, __ATOMIC_RELAXED));
+  if (drv->send == sim_send)
+    snprintf(msg + nc, LINESIZE - nc, " - latency = %.1f us (%.1f us per "
+	     "actuator)", sim_latency, sim_latency_one);
+  return msg;
+}
+
+void set_sim_latency(double dt) {
+  /* -------------------------------------------------------------------------
+   *       Updates the duration of a simulated driver call (in us)
+   * ------------------------------------------------------------------------- */
+  sim_latency = (dt > 0) ? dt : 0.0;
+  printf("Simulated driver latency = %.1f us\n", sim_latency);
+}
+
+void set_sim_latency_one(double dt) {
+  /* -------------------------------------------------------------------------
+   *   Updates the duration of a simulated single actuator call (in us)
+   * ------------------------------------------------------------------------- */
+  sim_latency_one = (dt > 0) ? dt : 0.0;
+  printf("Simulated single actuator latency = %.1f us\n", sim_latency_one);
+}
+
+std::string get_delta() {
+  /* -------------------------------------------------------------------------
+   *               Returns the settings of the delta-aware writes
+   * ------------------------------------------------------------------------- */
+  char msg[LINESIZE];
+
+  if (!delta_on)
+    return "delta writes off: every command is sent in full";
+  snprintf(msg, LINESIZE, "unchanged commands skipped - single actuator "
+	   "writes for up to %d changes%s", partial_max,
+	   (drv->send_one == NULL) ? " (not supported by the backend)" : "");
+  return msg;
+}
+
+std::string set_delta(int on, int nmax) {
+  /* -------------------------------------------------------------------------
+   *   Turns the delta-aware writes on (1) or off (0): unchanged commands
+   *   are not sent, and up to nmax changed actuators are sent one by one
+   * ------------------------------------------------------------------------- */
+  __atomic_store_n(&partial_max, (nmax > 0) ? nmax : 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&delta_on, (on != 0), __ATOMIC_RELAXED);
+  return get_delta();
+}
+
+std::string driver_bench(int niter, int nchg) {
+  /* -------------------------------------------------------------------------
+   *   Measures the # of writes per second through the simulated driver
+   *   (with the current simulated latencies), on a scratch DM: full writes,
+   *   delta writes of an unchanged command, and of commands with nchg
+   *   changed actuators sent in full or one actuator at a time
+   * ------------------------------------------------------------------------- */
+  const char *names[4] = {"full", "unchanged", "changed", "partial"};
+  int delta[4] = {0, 1, 1, 1};
+  struct timespec t0, t1;
+  double *cmd[2], rate[4];
+  const DRIVER *sim = NULL;
+  HEXDM *dm = NULL;
+  int ii, kk, nmax;
+  std::string res;
+  char msg[LINESIZE];
+
+  if (niter <= 0) niter = 10000;
+  if ((nchg < 1) || (nchg > nvact)) nchg = 10;
+  for (auto &backend : drivers)
+    if (strcmp(backend.name, "sim") == 0)
+      sim = &backend;
+
+  if (posix_memalign((void **) &dm, CACHELINE, sizeof(HEXDM)) != 0)
+    return "Failed to allocate the scratch DM";
+  memset((void *) dm, 0, sizeof(HEXDM));
+  snprintf(dm->serial, LINESIZE, "bench");
+  dm->sim_cmd = alloc_aligned(csz);
+  dm->dac_last = (uint16_t *) calloc(csz, sizeof(uint16_t));
+  dm->dac_idx = (int *) calloc(csz, sizeof(int));
+  cmd[0] = alloc_aligned(csz);
+  cmd[1] = alloc_aligned(csz);
+  srand(3);
+  for (ii = 0; ii < nvact; ii++) // cmd[1]: nchg actuators a few DAC steps off
+    cmd[0][ii] = cmd[1][ii] = 0.2 + 0.6 * (rand() / (double) RAND_MAX);
+  for (ii = 0; ii < nchg; ii++)
+    cmd[1][ii * (nvact / nchg)] += 4.0 / DAC_LEVELS;
+
+  for (kk = 0; kk < 4; kk++) {
+    nmax = (kk == 3) ? nchg : 0;
+    dm->dac_known = 0;
+    driver_write_with(sim, dm, cmd[0], delta[kk], nmax);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (ii = 0; ii < niter; ii++) // unchanged: always cmd[0]
+      driver_write_with(sim, dm, cmd[(kk != 1) ? (ii + 1) % 2 : 0],
+			delta[kk], nmax);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    rate[kk] = niter / ((t1.tv_sec - t0.tv_sec) +
+			(t1.tv_nsec - t0.tv_nsec) * 1e-9);
+  }
+
+  free(dm->sim_cmd);
+  free(dm->dac_last);
+  free(dm->dac_idx);
+  free(dm);
+  free(cmd[0]);
+  free(cmd[1]);
+  snprintf(msg, LINESIZE, "sim driver (latency %.1f us, %.1f us per actuator), "
+	   "%d changed actuators - writes/s:", sim_latency, sim_latency_one, nchg);
+  res = msg;
+  for (kk = 0; kk < 4; kk++) {
+    snprintf(msg, LINESIZE, " %s %.0f", names[kk], rate[kk]);
+    res += msg;
+  }
+  return res;
+}
+
+std::vector<double> get_last_cmd(int idm) {
+  /* -------------------------------------------------------------------------
+   *   Returns the last command received by the simulated driver of DM #idm
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+
+  if ((dm == NULL) || (dm->sim_cmd == NULL))
+    return std::vector<double>();
+  return std::vector<double>(dm->sim_cmd, dm->sim_cmd + csz);
+}
+
+void set_latency(int on) {
+  /* -------------------------------------------------------------------------
+   *            Turns the latency measurements on (1) or off (0)
+   * ------------------------------------------------------------------------- */
+  __atomic_store_n(&lat_on, (on != 0), __ATOMIC_RELAXED);
+  printf("Latency measurements %s\n", (on != 0) ? "on" : "off");
+}
+
+void latency_reset(int idm) {
+  /* -------------------------------------------------------------------------
+   *   Resets the latency histograms of DM #idm: right away when the loop
+   *   is stopped, by the driver thread after its next command otherwise
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+
+  if (dm == NULL) {
+    printf("%s\n", dm_unknown(idm).c_str());
+    return;
+  }
+  if (keepgoing == 1)
+    __atomic_store_n(&dm->lat_reset, dm->lat_reset + 1, __ATOMIC_RELEASE);
+  else {
+    memset(dm->lat_hist, 0, LAT_NSTAMP * sizeof(LATHIST));
+    dm->lat_gen = dm->lat_reset;
+  }
+}
+
+std::string latency_stats(int idm) {
+  /* -------------------------------------------------------------------------
+   *   Returns p50, p99, p99.9 and max of the latency of each stage (in us)
+   *   of the updates of DM #idm
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+  std::string res;
+  char line[LINESIZE];
+  double pct[3] = {0.5, 0.99, 0.999};
+  double pval[3];
+  int kk;
+  LATHIST *hist;
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  if (!lat_on)
+    res = "(latency measurements are off: set_latency 1)\n";
+  for (kk = 0; kk < LAT_NSTAMP; kk++) {
+    hist = &dm->lat_hist[kk];
+    lat_percentiles(hist, pct, 3, pval);
+    snprintf(line, LINESIZE,
+	     "%-8s n=%lu p50=%.1f p99=%.1f p99.9=%.1f max=%.1f us\n",
+	     lat_names[kk],
+	     (unsigned long) __atomic_load_n(&hist->count, __ATOMIC_RELAXED),
+	     pval[0] * 1e-3, pval[1] * 1e-3, pval[2] * 1e-3,
+	     __atomic_load_n(&hist->vmax, __ATOMIC_RELAXED) * 1e-3);
+    res += line;
+  }
+  return res;
+}
+
+std::vector<std::vector<int64_t>> latency_records(int idm, int nrec) {
+  /* -------------------------------------------------------------------------
+   *   Returns the last nrec time stamp records of DM #idm: frame # followed
+   *   by the write, wake, combine, convert and sent time stamps (in ns)
+   * ------------------------------------------------------------------------- */
+  std::vector<std::vector<int64_t>> res;
+  HEXDM *dm = dm_get(idm);
+  uint64_t head, irec;
+  LATREC *rec;
+
+  if (dm == NULL)
+    return res;
+  head = __atomic_load_n(&dm->lat_head, __ATOMIC_ACQUIRE);
+  if (nrec > LAT_NREC / 2) nrec = LAT_NREC / 2; // keep clear of the writer
+  irec = (head > (uint64_t) nrec) ? head - nrec : 0;
+  for (; irec < head; irec++) {
+    rec = &dm->lat_ring[irec % LAT_NREC];
+    res.push_back(std::vector<int64_t>(1, (int64_t) rec->frame));
+    res.back().insert(res.back().end(), rec->t, rec->t + LAT_NSTAMP);
+  }
+  return res;
+}
+
+std::string set_rt_sched(std::string policy, int prio) {
+  /* -------------------------------------------------------------------------
+   *   Updates the scheduling policy (fifo, rr or other) & priority of the
+   *   control loop, driver, channel watcher and playback threads of all
+   *   the DMs
+   * ------------------------------------------------------------------------- */
+  if (policy == "fifo") rt_policy = SCHED_FIFO;
+  else if (policy == "rr") rt_policy = SCHED_RR;
+  else if (policy == "other") rt_policy = SCHED_OTHER;
+  else return "Unknown scheduling policy: " + policy;
+  rt_prio = prio;
+  return rt_apply();
+}
+
+std::string set_loop_cpu(int idm, int cpu) {
+  /* -------------------------------------------------------------------------
+   *   Pins the control loop of DM #idm to CPU #arg_1 (-1: no pinning)
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  dm->loop_cpu = cpu;
+  return rt_apply();
+}
+
+std::string set_drv_cpu(int idm, int cpu) {
+  /* -------------------------------------------------------------------------
+   *   Pins the driver thread of DM #idm to CPU #arg_1 (-1: no pinning)
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  dm->drv_cpu = cpu;
+  return rt_apply();
+}
+
+std::string set_mlock(int on) {
+  /* -------------------------------------------------------------------------
+   *    Locks (1) or unlocks (0) the memory, prefaulting the loop buffers
+   * ------------------------------------------------------------------------- */
+  int err = memory_lock(on);
+
+  if (err != 0)
+    return std::string("memory lock failed: ") + strerror(err);
+  mem_lock = (on != 0);
+  return mem_lock ? "memory locked" : "memory unlocked";
+}
+
+std::string rt_status() {
+  /* -------------------------------------------------------------------------
+   *     Returns the real-time settings requested and actually in effect
+   * ------------------------------------------------------------------------- */
+  char msg[LINESIZE];
+  std::string res;
+  int kk;
+
+  snprintf(msg, LINESIZE, "requested: %s prio %d\n",
+	   rt_policy_name(rt_policy), rt_prio);
+  res = msg;
+  for (kk = 0; kk < ndm; kk++) {
+    snprintf(msg, LINESIZE, "DM%d: loop CPU %d - driver CPU %d\n",
+	     dms[kk].idm, dms[kk].loop_cpu, dms[kk].drv_cpu);
+    res += msg;
+  }
+  if (keepgoing == 0)
+    return res + (mem_lock ? "memory locked\n" : "memory not locked\n")
+      + "DM control loop not running";
+  return res + rt_report();
+}
+
+std::string get_wait() {
+  /* -------------------------------------------------------------------------
+   *            Returns how the control loops wait for updates
+   * ------------------------------------------------------------------------- */
+  char msg[LINESIZE];
+
+  if (wait_mode == WAIT_HYBRID)
+    snprintf(msg, LINESIZE, "%s (spin %.1f us)", wait_names[wait_mode], spin_us);
+  else
+    snprintf(msg, LINESIZE, "%s", wait_names[wait_mode]);
+  return msg;
+}
+
+std::string set_wait(std::string mode, double spin) {
+  /* -------------------------------------------------------------------------
+   *   Selects how the control loops wait for updates: sem, poll or hybrid
+   *   (spinning for arg_1 us before blocking). Applies right away.
+   * ------------------------------------------------------------------------- */
+  for (int kk = 0; kk < 3; kk++)
+    if (mode == wait_names[kk]) {
+      spin_us = (spin > 0) ? spin : 0.0;
+      __atomic_store_n(&wait_mode, kk, __ATOMIC_RELAXED);
+      return get_wait();
+    }
+  return "Unknown wait mode: " + mode + " (sem, poll or hybrid)";
+}
+
+std::string set_sync(int on) {
+  /* -------------------------------------------------------------------------
+   *   Turns the synchronous update of the DMs on (1) or off (0). Only when
+   *   the loop is stopped: the mode is used when it is started.
+   * ------------------------------------------------------------------------- */
+  if (keepgoing == 1)
+    return "DM control loop running: stop it before changing the mode";
+  sync_on = (on != 0);
+  return sync_on ? "synchronous DM updates" : "independent DM updates";
+}
+
+std::string sync_stats() {
+  /* -------------------------------------------------------------------------
+   *   Returns the # of synchronous cycles and the statistics of the skew
+   *   between the submissions of the commands to the DMs (in us)
+   * ------------------------------------------------------------------------- */
+  double pct[3] = {0.5, 0.99, 0.999};
+  double pval[3];
+  char msg[LINESIZE];
+
+  lat_percentiles(sync_hist, pct, 3, pval);
+  snprintf(msg, LINESIZE, "%s - cycles: %lu - skew last=%.2f p50=%.2f "
+	   "p99=%.2f p99.9=%.2f max=%.2f us",
+	   sync_on ? "synchronous" : "independent",
+	   (unsigned long) __atomic_load_n(&sync_ncycle, __ATOMIC_RELAXED),
+	   __atomic_load_n(&sync_last, __ATOMIC_RELAXED) * 1e-3,
+	   pval[0] * 1e-3, pval[1] * 1e-3, pval[2] * 1e-3,
+	   __atomic_load_n(&sync_hist->vmax, __ATOMIC_RELAXED) * 1e-3);
+  return msg;
+}
+
+void sync_reset() {
+  /* -------------------------------------------------------------------------
+   *                  Resets the submission skew statistics
+   * ------------------------------------------------------------------------- */
+  memset(sync_hist, 0, sizeof(LATHIST));
+  sync_ncycle = 0;
+  sync_last = 0;
+}
+
+std::string snap_stats(int idm) {
+  /* -------------------------------------------------------------------------
+   *   Returns the # of channel reads of DM #idm discarded because a write
+   *   was going on
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+  char msg[LINESIZE];
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  snprintf(msg, LINESIZE, "torn reads: %lu - budget (%d) exhausted: %lu",
+	   (unsigned long) __atomic_load_n(&dm->torn_reads, __ATOMIC_RELAXED),
+	   snap_budget,
+	   (unsigned long) __atomic_load_n(&dm->snap_fails, __ATOMIC_RELAXED));
+  return msg;
+}
+
+std::string get_rate_limit() {
+  /* -------------------------------------------------------------------------
+   *         Returns the settings of the rate limiter of the DM commands
+   * ------------------------------------------------------------------------- */
+  char msg[LINESIZE];
+
+  if (rl_period <= 0)
+    return "no rate limit";
+  snprintf(msg, LINESIZE, "max rate = %.1f Hz - min interval = %.1f us "
+	   "(one command every %.1f us at most)", max_rate, min_interval,
+	   rl_period * 1e-3);
+  return msg;
+}
+
+std::string set_rate_limit(double rate, double interval) {
+  /* -------------------------------------------------------------------------
+   *   Limits the commands of each DM to arg_0 per second and to one every
+   *   arg_1 us (0 for no limit). Applies right away.
+   * ------------------------------------------------------------------------- */
+  double period = 0.0;   // in ns
+
+  max_rate = (rate > 0) ? rate : 0.0;
+  min_interval = (interval > 0) ? interval : 0.0;
+  if (max_rate > 0)
+    period = 1e9 / max_rate;
+  period = fmax(period, min_interval * 1e3);
+  __atomic_store_n(&rl_period, (int64_t) period, __ATOMIC_RELAXED);
+  return get_rate_limit();
+}
+
+std::string rate_stats(int idm) {
+  /* -------------------------------------------------------------------------
+   *   Returns the # of commands of DM #idm computed, delayed by the rate
+   *   limiter and dropped, and the # of channel updates coalesced
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+  char msg[LINESIZE];
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  snprintf(msg, LINESIZE, "commands: %lu - delayed: %lu - dropped: %lu - "
+	   "channel updates coalesced: %lu",
+	   (unsigned long) __atomic_load_n(&dm->nframes, __ATOMIC_RELAXED),
+	   (unsigned long) __atomic_load_n(&dm->rl_ndefer, __ATOMIC_RELAXED),
+	   (unsigned long) __atomic_load_n(&dm->cmd_ndrop, __ATOMIC_RELAXED),
+	   (unsigned long) __atomic_load_n(&dm->rl_ncoal, __ATOMIC_RELAXED));
+  return msg;
+}
+
+std::string tlm_record(int idm, std::string fname) {
+  /* -------------------------------------------------------------------------
+   *   Starts saving the telemetry of DM #idm to the FITS file fname (from
+   *   the next command sent on). A recording in progress is closed first.
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+  char hdr[FITS_BLOCK];
+  char msg[LINESIZE];
+  int fd;
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  if (dm->tlm_im == NULL)
+    return "No telemetry: start the server with --tlm <depth>";
+  if ((fd = open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    snprintf(msg, LINESIZE, "Failed to open %s: %s", fname.c_str(),
+	     strerror(errno));
+    return msg;
+  }
+  tlm_header(dm, 0, hdr);
+  if (write(fd, hdr, FITS_BLOCK) != FITS_BLOCK) {
+    close(fd);
+    return "Failed to write the header of " + fname;
+  }
+
+  pthread_mutex_lock(&dm->tlm_mutex);
+  tlm_save(dm);
+  tlm_close(dm);
+  snprintf(dm->tlm_file, LINESIZE, "%s", fname.c_str());
+  dm->tlm_next = __atomic_load_n(&dm->tlm_im->md->cnt0, __ATOMIC_ACQUIRE);
+  dm->tlm_nsaved = 0;
+  dm->tlm_nlost = 0;
+  dm->tlm_fd = fd;
+  pthread_mutex_unlock(&dm->tlm_mutex);
+  return "Recording the telemetry of DM" + std::to_string(idm) + " to " + fname;
+}
+
+std::string tlm_stop(int idm) {
+  /* -------------------------------------------------------------------------
+   *       Stops saving the telemetry of DM #idm and closes the file
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  pthread_mutex_lock(&dm->tlm_mutex);
+  tlm_save(dm);
+  tlm_close(dm);
+  pthread_mutex_unlock(&dm->tlm_mutex);
+  return tlm_stats(idm);
+}
+
+std::string tlm_stats(int idm) {
+  /* -------------------------------------------------------------------------
+   *   Returns the state of the telemetry of DM #idm: frames in the cube,
+   *   and frames saved and lost by the last recording
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+  std::string res;
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  if (dm->tlm_im == NULL)
+    return "No telemetry (--tlm 0)";
+  pthread_mutex_lock(&dm->tlm_mutex);
+  res = "cube: " + std::to_string(__atomic_load_n(&dm->tlm_im->md->cnt0,
+						  __ATOMIC_RELAXED))
+    + " frames (depth " + std::to_string(tlm_depth) + ") - "
+    + ((dm->tlm_fd >= 0) ? "recording to " : "last recording: ")
+    + ((dm->tlm_file[0] != '\0') ? dm->tlm_file : "none") + ": "
+    + std::to_string(dm->tlm_nsaved) + " frames saved - "
+    + std::to_string(dm->tlm_nlost) + " lost";
+  pthread_mutex_unlock(&dm->tlm_mutex);
+  return res;
+}
+
+std::string play_launch(int idm, std::string fname, double rate,
+			std::string trigger) {
+  /* -------------------------------------------------------------------------
+   *   Starts the playback of the sequence fname into the play channel of
+   *   DM #idm (created if needed): at rate frames per second, or on each
+   *   update of the trigger shm when trigger is not empty. A playback in
+   *   progress is stopped first.
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+  PLAYBACK *pb;
+  CHANNEL *play;
+  std::string err, res;
+  char msg[LINESIZE];
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  if ((trigger == "") && (rate <= 0))
+    return "The playback rate must be > 0";
+
+  play_halt(dm);
+  free(dm->play);
+  dm->play = pb = (PLAYBACK *) calloc(1, sizeof(PLAYBACK));
+  pb->semidx = -1;
+  snprintf(pb->file, LINESIZE, "%s", fname.c_str());
+  if (((err = play_map(pb, fname.c_str())) == "") && (trigger != "")) {
+    if (ImageStreamIO_openIm(&pb->trig, trigger.c_str()) != IMAGESTRUCT_SUCCESS)
+      err = "Failed to open the trigger stream " + trigger;
+    else {
+      snprintf(pb->trig_name, LINESIZE, "%s", trigger.c_str());
+      if ((pb->semidx = ImageStreamIO_getsemwaitindex(&pb->trig, 0)) < 0)
+	err = "No free semaphore in the trigger stream " + trigger;
+      else
+	ImageStreamIO_semflush(&pb->trig, pb->semidx);
+    }
+  }
+  if (err != "") {
+    play_halt(dm);
+    free(dm->play);
+    dm->play = NULL;
+    return err;
+  }
+  pb->rate = rate;
+
+  if ((play = dm->chans->chan[PLAY0]) == NULL) {
+    play = chan_create(dm, PLAY0, 0);
+    chan_table_set(dm, dm->chans->nch, dm->chans->nact, dm->chans->chan[MODE0],
+		   play);
+  }
+  pb->chan = play;
+  pb->running = 1;
+  pthread_create(&pb->tid, NULL, play_loop, dm);
+  thread_rt_apply(pb->tid, -1); // same scheduling as the DM threads
+
+  res = "Playing " + std::to_string(pb->nfrm) + " frames of " + pb->file;
+  if (trigger != "")
+    return res + " on the updates of " + pb->trig_name;
+  snprintf(msg, LINESIZE, " at %.1f Hz", pb->rate);
+  return res + msg;
+}
+
+std::string play_start(int idm, std::string fname, double rate) {
+  /* -------------------------------------------------------------------------
+   *   Plays the sequence file fname into DM #idm at rate frames per second
+   * ------------------------------------------------------------------------- */
+  return play_launch(idm, fname, rate, "");
+}
+
+std::string play_sync(int idm, std::string fname, std::string trigger) {
+  /* -------------------------------------------------------------------------
+   *   Plays the sequence file fname into DM #idm, one frame per update of
+   *   the trigger shm
+   * ------------------------------------------------------------------------- */
+  if (trigger == "")
+    return "No trigger stream given";
+  return play_launch(idm, fname, 0.0, trigger);
+}
+
+std::string play_stop(int idm) {
+  /* -------------------------------------------------------------------------
+   *   Stops the playback of DM #idm and removes its play channel
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  play_halt(dm);
+  chan_table_set(dm, dm->chans->nch, dm->chans->nact, dm->chans->chan[MODE0],
+		 NULL);
+  return play_stats(idm);
+}
+
+std::string play_stats(int idm) {
+  /* -------------------------------------------------------------------------
+   *   Returns the progress of the playback of DM #idm, the # of deadlines
+   *   missed and the statistics of the lateness of the frames (in us)
+   * ------------------------------------------------------------------------- */
+  HEXDM *dm = dm_get(idm);
+  PLAYBACK *pb;
+  double pct[3] = {0.5, 0.99, 0.999};
+  double pval[3];
+  char msg[LINESIZE];
+
+  if (dm == NULL)
+    return dm_unknown(idm);
+  if ((pb = dm->play) == NULL)
+    return "No playback";
+  lat_percentiles(&pb->hist, pct, 3, pval);
+  snprintf(msg, LINESIZE, ": %lu / %lu frames%s - missed: %lu - late "
+	   "p50=%.2f p99=%.2f p99.9=%.2f max=%.2f us",
+	   (unsigned long) __atomic_load_n(&pb->nplayed, __ATOMIC_RELAXED),
+	   (unsigned long) pb->nfrm,
+	   __atomic_load_n(&pb->running, __ATOMIC_ACQUIRE) ? " (playing)" : "",
+	   (unsigned long) __atomic_load_n(&pb->nmiss, __ATOMIC_RELAXED),
+	   pval[0] * 1e-3, pval[1] * 1e-3, pval[2] * 1e-3,
+	   __atomic_load_n(&pb->hist.vmax, __ATOMIC_RELAXED) * 1e-3);
+  return pb->file + std::string(msg);
+}
+
+long hot_path_allocs() {
+  /* -------------------------------------------------------------------------
+   *   Returns the # of heap allocations made by the control loops (debug)
+   * ------------------------------------------------------------------------- */
+#ifdef HOTPATH_ALLOC_CHECK
+  return (long) __atomic_load_n(&hot_allocs, __ATOMIC_RELAXED);
+#else
+  printf("Allocation check not compiled in (make ALLOC_CHECK=1)\n");
+  return -1;
+#endif
+}
+
+void quit() {
+  /* -------------------------------------------------------------------------
+   *                       Clean exit of the program.
+   * ------------------------------------------------------------------------- */
+  int ii;
+
+  if (keepgoing == 1) stop();
+
+  printf("DM driver server shutting down!\n");
+
+  for (ii = 0; ii < ndm; ii++) {
+    drv->close(&dms[ii]);
+    dm_free(&dms[ii]);
+  }
+  free(dms);
+  for (ii = 0; ii < ncalib; ii++)
+    free(calib_band[ii]);
+  free(sync_hist);
+  exit(0);
+}
+
+namespace co=commander;
+namespace po=boost::program_options;
+
+COMMANDER_REGISTER(m) {
+  using namespace co::literals;
+  m.def("start", start, "Starts monitoring shared memory data structures.");
+  m.def("stop", stop, "Stops monitoring shared memory data structures.");
+  m.def("status", status, "Returns status of the DM server.");
+  m.def("get_ndm", get_ndm, "Returns the number of DMs driven by the server.");
+  m.def("get_serial", get_serial,
+	"Returns the identifier and shm names of DM #arg_0.");
+  m.def("get_nch", get_nch, "Returns the number of virtual channels of DM #arg_0.");
+  m.def("set_nch", set_nch, "Updates the number of virtual channels of DM #arg_0.");
+  m.def("get_nact", get_nact,
+	"Returns the number of actuator channels of DM #arg_0.");
+  m.def("set_nact", set_nact,
+	"Updates the number of actuator channels of DM #arg_0.");
+  m.def("reset", reset, "Resets channel #arg_1 of DM #arg_0 (all PTT & actuator channels if arg_1=-1).");
+  m.def("set_gain", set_gain,
+	"Sets the gain of channel #arg_1 of DM #arg_0 (all if arg_1=-1) to arg_2.");
+  m.def("mute", mute,
+	"Leaves channel #arg_1 of DM #arg_0 (all if arg_1=-1) out of the sum.");
+  m.def("unmute", unmute,
+	"Adds channel #arg_1 of DM #arg_0 (all if arg_1=-1) to the sum again.");
+  m.def("load_weight", load_weight,
+	"Loads the weights file arg_2 (one per channel element, or \"none\") for channel #arg_1 of DM #arg_0.");
+  m.def("load_modes", load_modes,
+	"Loads the mode -> PTT basis file arg_1 (or \"none\") of the modal channel of DM #arg_0.");
+  m.def("chan_status", chan_status,
+	"Returns the number, gain and state of the channels of DM #arg_0.");
+  m.def("load_calib", load_calib,
+	"Loads the PTT -> actuator calibration file arg_1 (or \"ideal\") for DM #arg_0.");
+  m.def("get_calib", get_calib,
+	"Returns the origin of the PTT -> actuator calibration of DM #arg_0.");
+  m.def("load_flat", load_flat,
+	"Loads the flat map file arg_1 (or \"none\") for DM #arg_0.");
+  m.def("get_flat", get_flat, "Returns the origin of the flat map of DM #arg_0.");
+  m.def("load_limits", load_limits,
+	"Loads the command limits file arg_1 (or \"default\") for DM #arg_0.");
+  m.def("get_limits", get_limits,
+	"Returns the origin of the command limits of DM #arg_0.");
+  m.def("clip_stats", clip_stats,
+	"Returns the statistics of the clipped commands of DM #arg_0.");
+  m.def("get_driver", get_driver,
+	"Returns the driver backend in use and its statistics for DM #arg_0.");
+  m.def("set_sim_latency", set_sim_latency,
+	"Sets the duration of a simulated driver call to arg_0 us.");
+  m.def("set_sim_latency_one", set_sim_latency_one,
+	"Sets the duration of a simulated single actuator call to arg_0 us.");
+  m.def("set_delta", set_delta,
+	"Skips unchanged commands (arg_0=1) and sends up to arg_1 changed actuators one by one.");
+  m.def("get_delta", get_delta, "Returns the settings of the delta-aware writes.");
+  m.def("get_last_cmd", get_last_cmd,
+	"Returns the last command received by the simulated DM #arg_0.");
+  m.def("set_latency", set_latency,
+	"Turns the latency measurements on (arg_0=1) or off (arg_0=0).");
+  m.def("latency_reset", latency_reset,
+	"Resets the latency histograms of DM #arg_0.");
+  m.def("latency_stats", latency_stats,
+	"Returns the latency statistics of each stage of the DM #arg_0 updates.");
+  m.def("latency_records", latency_records,
+	"Returns the time stamps of the last arg_1 updates of DM #arg_0.");
+  m.def("set_rt_sched", set_rt_sched,
+	"Sets the scheduling policy arg_0 (fifo, rr, other) & priority arg_1.");
+  m.def("set_loop_cpu", set_loop_cpu,
+	"Pins the control loop of DM #arg_0 to CPU #arg_1 (-1 = no pinning).");
+  m.def("set_drv_cpu", set_drv_cpu,
+	"Pins the driver thread of DM #arg_0 to CPU #arg_1 (-1 = no pinning).");
+  m.def("set_mlock", set_mlock,
+	"Locks (arg_0=1) or unlocks (arg_0=0) the memory of the server.");
+  m.def("rt_status", rt_status, "Returns the real-time settings in effect.");
+  m.def("set_wait", set_wait,
+	"Sets the wait mode arg_0 (sem, poll, hybrid) with arg_1 us of spin.");
+  m.def("get_wait", get_wait, "Returns the wait mode of the control loops.");
+  m.def("set_sync", set_sync,
+	"Turns the synchronous update of the DMs on (arg_0=1) or off (arg_0=0).");
+  m.def("sync_stats", sync_stats,
+	"Returns the statistics of the skew between the DM submissions.");
+  m.def("sync_reset", sync_reset, "Resets the DM submission skew statistics.");
+  m.def("set_rate_limit", set_rate_limit,
+	"Limits the DM commands to arg_0 per second and one every arg_1 us (0: no limit).");
+  m.def("get_rate_limit", get_rate_limit,
+	"Returns the settings of the DM command rate limiter.");
+  m.def("rate_stats", rate_stats,
+	"Returns the # of commands delayed, dropped and of updates coalesced for DM #arg_0.");
+  m.def("tlm_record", tlm_record,
+	"Saves the telemetry of DM #arg_0 to the FITS file arg_1.");
+  m.def("tlm_stop", tlm_stop,
+	"Stops saving the telemetry of DM #arg_0.");
+  m.def("tlm_stats", tlm_stats,
+	"Returns the # of telemetry frames of DM #arg_0 saved and lost.");
+  m.def("play_start", play_start,
+	"Plays the FITS sequence arg_1 into DM #arg_0 at arg_2 frames per second.");
+  m.def("play_sync", play_sync,
+	"Plays the FITS sequence arg_1 into DM #arg_0 on each update of shm arg_2.");
+  m.def("play_stop", play_stop,
+	"Stops the playback of DM #arg_0 and removes its play channel.");
+  m.def("play_stats", play_stats,
+	"Returns the progress and timing statistics of the playback of DM #arg_0.");
+  m.def("snap_stats", snap_stats,
+	"Returns the # of channel reads of DM #arg_0 discarded during a write.");
+  m.def("get_dtype", get_dtype, "Returns the datatype of the channels.");
+  m.def("kernel_bench", kernel_bench,
+	"Times the PTT -> actuator conversion and the channel sum over arg_0 iterations.");
+  m.def("driver_bench", driver_bench,
+	"Measures the writes/s of the simulated driver over arg_0 iterations, full vs delta (arg_1 changed actuators).");
+  m.def("kernel_check", kernel_check,
+	"Checks all the PTT -> actuator kernels supported by the CPU against the reference.");
+  m.def("hot_path_allocs", hot_path_allocs,
+	"Returns the # of heap allocations made by the DM control loops.");
+}
+
+/* =========================================================================
+ *   value of a per-DM command line option for DM #kk+1: the options are
+ *   given once per DM (in the order of the --serial options), or once for
+ *   all of them
+ * ========================================================================= */
+template <typename T>
+T dm_option(const std::vector<T> &vals, int kk, T def) {
+  if ((int) vals.size() > kk)
+    return vals[kk];
+  return (vals.size() == 1) ? vals[0] : def;
+}
+
+/* =========================================================================
+ *                                Main program
+ * ========================================================================= */
+int main(int argc, char **argv) {
+  std::vector<std::string> serial;
+  std::vector<std::string> calib;
+  std::vector<std::string> flat;
+  std::vector<std::string> limits;
+  std::vector<std::string> modes;
+  std::vector<int> loop_cpu;
+  std::vector<int> drv_cpu;
+  std::string driver = "sim";
+  std::string policy = "other";
+  std::string wait = "sem";
+  std::string dtype = "double";
+  std::string fname;
+  HEXDM *dm;
+  int want_mlock = 0; // mem_lock is only set once the lock succeeded
+  int kk;
+
+  // ---------------- server specific command line options ----------------
+  // whatever is not recognized here is passed on to the commander server
+  po::options_description desc("HexDM server options");
+  desc.add_options()
+    ("serial", po::value<std::vector<std::string>>(&serial),
+     "DM identifier, repeated for each DM (default: 27BW007#051)")
+    ("calib", po::value<std::vector<std::string>>(&calib),
+     "PTT -> actuator calibration file (default: ideal geometry)")
+    ("flat", po::value<std::vector<std::string>>(&flat),
+     "flat map file added to the DM command (default: none)")
+    ("limits", po::value<std::vector<std::string>>(&limits),
+     "per-actuator command limits file (default: [0, 1] for all)")
+    ("modes", po::value<std::vector<std::string>>(&modes),
+     "mode -> PTT basis file of the modal channel (default: none)")
+    ("nact", po::value<int>(&nact_def),
+     "number of actuator channels per DM (default: 0)")
+    ("dtype", po::value<std::string>(&dtype),
+     "datatype of the channels: double (default) or float")
+    ("driver", po::value<std::string>(&driver),
+     "driver backend: bmc (the DM) or sim (simulated, default)")
+    ("sim_latency", po::value<double>(&sim_latency),
+     "duration of a simulated driver call in us (default: 0)")
+    ("sim_latency_one", po::value<double>(&sim_latency_one),
+     "duration of a simulated single actuator call in us (default: 0)")
+    ("delta", po::value<int>(&delta_on),
+     "skip the commands unchanged at the DAC resolution: 0 or 1 (default)")
+    ("partial_max", po::value<int>(&partial_max),
+     "max # of changed actuators sent one by one (default: 0)")
+    ("latency", po::value<int>(&lat_on),
+     "measure the latency of the DM updates: 0 (default) or 1")
+    ("rt_policy", po::value<std::string>(&policy),
+     "scheduling policy of the DM threads: fifo, rr or other (default)")
+    ("rt_prio", po::value<int>(&rt_prio),
+     "real-time priority of the DM threads (fifo or rr policy)")
+    ("loop_cpu", po::value<std::vector<int>>(&loop_cpu),
+     "CPU the DM control loop is pinned to (default: none)")
+    ("drv_cpu", po::value<std::vector<int>>(&drv_cpu),
+     "CPU the driver thread is pinned to (default: none)")
+    ("sync", po::value<int>(&sync_on),
+     "update the DMs synchronously: 0 (default) or 1")
+    ("mlock", po::value<int>(&want_mlock),
+     "lock the memory & prefault the buffers: 0 (default) or 1")
+    ("wait", po::value<std::string>(&wait),
+     "how the loop waits for updates: sem (default), poll or hybrid")
+    ("spin_us", po::value<double>(&spin_us),
+     "duration of the spin phase in hybrid wait mode (default: 50 us)")
+    ("max_rate", po::value<double>(&max_rate),
+     "max # of commands per second sent to each DM (default: no limit)")
+    ("min_interval", po::value<double>(&min_interval),
+     "min time between two commands sent to a DM in us (default: none)")
+    ("tlm", po::value<int>(&tlm_depth),
+     "# of frames of the telemetry cubes (default: 0, no telemetry)");
+
+  po::variables_map vm;
+  po::parsed_options parsed = po::command_line_parser(argc, argv)
+    .options(desc).allow_unregistered().run();
+  po::store(parsed, vm);
+  po::notify(vm);
+
+  for (auto &backend : drivers)
+    if (driver == backend.name)
+      drv = &backend;
+  if (drv == NULL) {
+    printf("Unknown driver backend: %s\n", driver.c_str());
+    exit(1);
+  }
+
+  if ((tlm_depth < 0) || (tlm_depth == 1)) {
+    printf("Invalid telemetry depth: %d (0 or at least 2)\n", tlm_depth);
+    exit(1);
+  }
+  if ((nact_def < 0) || (nact_def > NCH_MAX)) {
+    printf("Invalid # of actuator channels: %d (0-%d)\n", nact_def, NCH_MAX);
+    exit(1);
+  }
+  if (dtype == "float") {
+    chan_type = _DATATYPE_FLOAT;
+    chan_esz = sizeof(float);
+  }
+  else if (dtype != "double") {
+    printf("Unknown channel datatype: %s\n", dtype.c_str());
+    exit(1);
+  }
+
+  // one DM per --serial option; the calib, flat, limits, modes, loop_cpu and
+  // drv_cpu options are given either once per DM or once for all of them
+  if (serial.empty())
+    serial.push_back(snumber);
+  ndm = (int) serial.size();
+  for (size_t nopt : {calib.size(), flat.size(), limits.size(),
+		      modes.size(), loop_cpu.size(), drv_cpu.size()})
+    if ((nopt > 1) && ((int) nopt != ndm)) {
+      printf("Per-DM options must be given once, or once for each of the %d DMs\n",
+	     ndm);
+      exit(1);
+    }
+
+  std::vector<std::string> co_args =
+    po::collect_unrecognized(parsed.options, po::include_positional);
+  std::vector<char *> co_argv(1, argv[0]);
+  for (auto &arg : co_args)
+    co_argv.push_back(&arg[0]);
+
+  ptt_kernel_select();
+  sem_init(&sync_sem, 0, 0);
+  sem_init(&sync_done_sem, 0, 0);
+  sync_hist = (LATHIST *) calloc(1, sizeof(LATHIST));
+  if (posix_memalign((void **) &dms, CACHELINE, ndm * sizeof(HEXDM)) != 0) {
+    printf("Failed to allocate %d DMs\n", ndm);
+    exit(1);
+  }
+  for (kk = 0; kk < ndm; kk++) {
+    dm = &dms[kk];
+    dm_alloc(dm, kk + 1, serial[kk].c_str());
+    dm->loop_cpu = dm_option(loop_cpu, kk, -1);
+    dm->drv_cpu = dm_option(drv_cpu, kk, -1);
+
+    load_limits(dm->idm, "default");
+    load_calib(dm->idm, "ideal");
+    fname = dm_option(calib, kk, std::string("ideal"));
+    if (fname != "ideal") {
+      printf("DM%d: %s\n", dm->idm, load_calib(dm->idm, fname).c_str());
+      if (fname != dm->calib_file)
+	exit(1);
+    }
+    fname = dm_option(flat, kk, std::string("none"));
+    if (fname != "none") {
+      printf("DM%d: %s\n", dm->idm, load_flat(dm->idm, fname).c_str());
+      if (fname != dm->flat_file)
+	exit(1);
+    }
+    fname = dm_option(limits, kk, std::string("default"));
+    if (fname != "default") {
+      printf("DM%d: %s\n", dm->idm, load_limits(dm->idm, fname).c_str());
+      if (fname != dm->lim_file)
+	exit(1);
+    }
+
+    drv->open(dm);
+    shm_setup(dm);
+    fname = dm_option(modes, kk, std::string("none"));
+    if (fname != "none") {
+      printf("DM%d: %s\n", dm->idm, load_modes(dm->idm, fname).c_str());
+      if (fname != dm->modes_file)
+	exit(1);
+    }
+  }
+  if (set_wait(wait, spin_us).rfind("Unknown", 0) == 0) {
+    printf("Unknown wait mode: %s\n", wait.c_str());
+    exit(1);
+  }
+  set_rate_limit(max_rate, min_interval);
+
+  // -------------------- real-time settings --------------------
+  if (policy == "fifo") rt_policy = SCHED_FIFO;
+  else if (policy == "rr") rt_policy = SCHED_RR;
+  else if (policy != "other") {
+    printf("Unknown scheduling policy: %s\n", policy.c_str());
+    exit(1);
+  }
+  if (rt_policy != SCHED_OTHER) {
+    if ((rt_prio < sched_get_priority_min(rt_policy)) ||
+	(rt_prio > sched_get_priority_max(rt_policy))) {
+      printf("Priority %d out of range for the %s policy\n",
+	     rt_prio, policy.c_str());
+      exit(1);
+    }
+  }
+  // try the settings on the main thread to report problems right away
+  {
+    pthread_t self = pthread_self();
+    struct sched_param param0;
+    int policy0, err;
+    cpu_set_t cpuset0;
+    char name[LINESIZE];
+
+    pthread_getschedparam(self, &policy0, &param0);
+    pthread_getaffinity_np(self, sizeof(cpuset0), &cpuset0);
+    for (kk = 0; kk < ndm; kk++) {
+      dm = &dms[kk];
+      if ((err = thread_rt_apply(self, dm->loop_cpu)) != 0)
+	printf("DM%d control loop real-time settings failed: %s\n",
+	       dm->idm, strerror(err));
+      snprintf(name, LINESIZE, "DM%d control loop (test)", dm->idm);
+      printf("%s\n", thread_rt_report(self, name).c_str());
+      if ((err = thread_rt_apply(self, dm->drv_cpu)) != 0)
+	printf("DM%d driver thread real-time settings failed: %s\n",
+	       dm->idm, strerror(err));
+      snprintf(name, LINESIZE, "DM%d driver thread (test)", dm->idm);
+      printf("%s\n", thread_rt_report(self, name).c_str());
+    }
+    pthread_setschedparam(self, policy0, &param0);  // restore
+    pthread_setaffinity_np(self, sizeof(cpuset0), &cpuset0);
   }
-  shm_setup();  // set up startup configuration
- 
+  if (want_mlock)
+    printf("%s\n", set_mlock(1).c_str());  // lock & prefault the memory
 
   // --------------------- set-up the prompt --------------------
   printf("%s", dashline);
@@ -364,7 +4521,7 @@ int main(int argc, char **argv) {
   printf("%s", dashline);
 
   // start the commander server
-  co::Server s(argc, argv);
+  co::Server s((int) co_argv.size(), co_argv.data());
   s.run();
   
   // --------------------------